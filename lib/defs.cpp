@@ -30,6 +30,18 @@ std::string mode_kind_to_string(ModeKind kind)
     case ModeKind::GLR16:
         return "GLR16";
 
+    case ModeKind::GL16:
+        return "GL16";
+
+    case ModeKind::A2_TRIMMED:
+        return "A2_TRIMMED";
+
+    case ModeKind::DU_TRIMMED:
+        return "DU_TRIMMED";
+
+    case ModeKind::AUTO:
+        return "AUTO";
+
     default:
         return "UNKNOWN";
     }
@@ -8,7 +8,9 @@
 #define WAVED_DEFS_HPP
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -57,6 +59,14 @@ using PhaseMatrix
  */
 using Waveform = std::vector<PhaseMatrix>;
 
+/**
+ * Set of intensity transitions.
+ *
+ * Indexed first by source intensity and then by target intensity.
+ */
+using TransitionSet
+    = std::array<std::array<bool, intensity_values>, intensity_values>;
+
 /** Screen region. */
 struct Region
 {
@@ -66,6 +76,109 @@ struct Region
     std::uint32_t height;
 };
 
+/** Screen location. */
+struct Point
+{
+    std::uint32_t top;
+    std::uint32_t left;
+};
+
+/**
+ * Coordinate systems in which update regions and pixels can be expressed.
+ *
+ * Rotations are relative to the usual portrait reMarkable coordinate system,
+ * whose origin is at the top left corner of the screen, and tell by how much
+ * the content is turned clockwise. In the 90° and 270° orientations,
+ * the screen is 1872 pixels wide and 1404 pixels high.
+ */
+enum class Orientation : std::uint8_t
+{
+    // Usual portrait orientation
+    ROTATE_0,
+
+    // Landscape orientation, with the top of the content on the right edge
+    // of the portrait screen
+    ROTATE_90,
+
+    // Upside-down portrait orientation
+    ROTATE_180,
+
+    // Landscape orientation, with the top of the content on the left edge
+    // of the portrait screen
+    ROTATE_270,
+
+    // Native coordinate system of the EPD, which requires no transform
+    // (see the diagram in display.hpp)
+    EPD,
+};
+
+/** Priority classes of updates, each with its own latency target. */
+enum class Priority : std::uint8_t
+{
+    // Updates that follow user input, such as pen strokes or key presses
+    HIGH,
+
+    // Regular updates
+    NORMAL,
+
+    // Updates that can wait, such as refreshes done in the background
+    LOW,
+};
+
+constexpr std::size_t priority_count = 3;
+
+/** Layouts of the pixels in a caller-supplied buffer. */
+enum class PixelFormat : std::uint8_t
+{
+    // One byte per pixel, holding an intensity
+    INTENSITY,
+
+    // One byte per pixel, holding a gray level from 0 (black) to 255 (white)
+    // which is quantized to 16 levels
+    GRAY8,
+
+    // Two pixels per byte, each holding a gray level from 0 (black) to 15
+    // (white). The leftmost pixel is stored in the high nibble
+    GRAY4,
+
+    // Eight pixels per byte, each either black (0) or white (1). The leftmost
+    // pixel is stored in the most significant bit
+    GRAY1,
+};
+
+/**
+ * Read-only view over a block of pixels in caller memory.
+ *
+ * Consecutive rows start `stride` bytes apart, which allows pointing to a
+ * sub-rectangle of a larger canvas without having to extract it first.
+ */
+struct BufferView
+{
+    // Pointer to the byte holding the first pixel of the first row
+    const std::uint8_t* data;
+
+    // Distance between the starts of two consecutive rows, in bytes
+    std::size_t stride;
+
+    // Layout of the pixels in each row
+    PixelFormat format = PixelFormat::INTENSITY;
+
+    // Number of pixels to skip at the start of each row. This allows pointing
+    // to sub-rectangles that do not start on a byte boundary for formats
+    // that pack several pixels per byte
+    std::uint8_t pixel_offset = 0;
+
+    // Coordinate system of the pixels and of the associated region.
+    // If unset, the display’s default orientation is used
+    std::optional<Orientation> orientation = {};
+
+    // Set if the memory stays valid for as long as the display is running,
+    // like a shared canvas. The pixels are then read by the display when it
+    // starts processing the update instead of being copied beforehand, so
+    // changes made in the meantime may be included in the update
+    bool shared = false;
+};
+
 /**
  * Waveform types.
  *
@@ -96,6 +209,21 @@ enum class ModeKind
 
     // Full resolution mode with support for Regal
     GLR16,
+
+    // Derived from GC16: same transitions, except that cells whose intensity
+    // does not change are left alone instead of flashing (frames left with
+    // nothing to do at the end of the waveforms are removed)
+    GL16,
+
+    // Derived from A2 and DU: same transitions, without the frames at the
+    // end of the waveforms that leave all cells unchanged
+    A2_TRIMMED,
+    DU_TRIMMED,
+
+    // Not an actual mode: lets the display pick, for each update, the
+    // fastest of the A2, DU, DU4 and GC16 modes that supports all the
+    // intensity transitions of the update
+    AUTO,
 };
 
 /** Get a human-readable name for a mode kind. */
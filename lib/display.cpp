@@ -5,6 +5,9 @@
  */
 
 #include "display.hpp"
+#include "stroke.hpp"
+#include "transform.hpp"
+#include <algorithm>
 #include <system_error>
 #include <chrono>
 #include <cstring>
@@ -14,11 +17,11 @@
 #include <filesystem>
 #include <iostream>
 #include <iomanip>
+#include <limits>
+#include <utility>
 #include <unistd.h>
 #include <fcntl.h>
-#include <linux/fb.h>
-#include <sys/ioctl.h>
-#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace fs = std::filesystem;
 namespace chrono = std::chrono;
@@ -26,8 +29,50 @@ namespace chrono = std::chrono;
 namespace
 {
 
-constexpr int fbioblank_off = FB_BLANK_POWERDOWN;
-constexpr int fbioblank_on = FB_BLANK_UNBLANK;
+// Intensity of a white cell
+constexpr Waved::Intensity white = 30;
+
+// Odd target intensity that makes GLR16 modes turn a white or near-white
+// cell white using a Regal transition, which removes the ghosting left
+// around it without flashing
+constexpr Waved::Intensity regal_white = 31;
+
+/**
+ * Replace the contents of a file.
+ *
+ * @throws std::system_error If writing fails.
+ */
+void write_contents(int fd, const std::string& contents)
+{
+    if (pwrite(fd, contents.data(), contents.size(), 0) == -1) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Write performance hint"
+        );
+    }
+
+    // Only regular files keep leftovers of longer previous contents
+    struct stat info;
+
+    if (
+        fstat(fd, &info) == 0
+        && S_ISREG(info.st_mode)
+        && ftruncate(fd, contents.size()) == -1
+    ) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Truncate performance hint"
+        );
+    }
+}
+
+/** Check whether a cell can receive a Regal transition. */
+inline bool is_regal_source(Waved::Intensity value)
+{
+    return value == 28 || value == 29 || value == white;
+}
 
 void copy_rect(
     const Waved::Intensity* source,
@@ -49,6 +94,31 @@ void copy_rect(
     }
 }
 
+/** Check whether two regions have pixels in common. */
+bool intersect_regions(Waved::Region a, Waved::Region b)
+{
+    return a.left < b.left + b.width && b.left < a.left + a.width
+        && a.top < b.top + b.height && b.top < a.top + a.height;
+}
+
+/** Check whether a region contains another one. */
+bool contains_region(Waved::Region outer, Waved::Region inner)
+{
+    return outer.left <= inner.left && outer.top <= inner.top
+        && inner.left + inner.width <= outer.left + outer.width
+        && inner.top + inner.height <= outer.top + outer.height;
+}
+
+/** Get the smallest region containing two regions. */
+Waved::Region merge_regions(Waved::Region a, Waved::Region b)
+{
+    auto top = std::min(a.top, b.top);
+    auto left = std::min(a.left, b.left);
+    auto width = std::max(a.left + a.width, b.left + b.width) - left;
+    auto height = std::max(a.top + a.height, b.top + b.height) - top;
+    return Waved::Region{top, left, width, height};
+}
+
 #ifdef ENABLE_PERF_REPORT
 std::ostream& operator<<(std::ostream& out, chrono::steady_clock::time_point t)
 {
@@ -84,10 +154,51 @@ Display::Display(
     const char* temperature_sensor_path,
     WaveformTable waveform_table
 )
+: Display(
+    std::make_unique<MxsfbSink>(framebuffer_path),
+    temperature_sensor_path,
+    std::move(waveform_table)
+)
+{}
+
+Display::Display(
+    std::unique_ptr<FrameSink> sink,
+    const char* temperature_sensor_path,
+    WaveformTable waveform_table
+)
 : table(std::move(waveform_table))
-, framebuffer_fd(framebuffer_path, O_RDWR)
+, sink(std::move(sink))
 , temp_sensor_fd(temperature_sensor_path, O_RDONLY)
-{}
+{
+    constexpr ModeKind auto_kinds[] = {
+        ModeKind::A2, ModeKind::DU, ModeKind::DU4, ModeKind::GC16
+    };
+
+    for (auto kind : auto_kinds) {
+        for (ModeID mode = 0; mode < this->table.get_mode_count(); ++mode) {
+            if (this->table.get_mode_kind(mode) == kind) {
+                this->auto_modes.push_back(mode);
+                break;
+            }
+        }
+    }
+
+    for (ModeID mode = 0; mode < this->table.get_mode_count(); ++mode) {
+        if (this->table.get_mode_kind(mode) == ModeKind::GC16) {
+            this->cleanup_mode = mode;
+            this->cleanup_threshold = default_cleanup_threshold;
+            break;
+        }
+    }
+
+    for (ModeID mode = 0; mode < this->table.get_mode_count(); ++mode) {
+        if (this->table.get_mode_kind(mode) == ModeKind::GLR16) {
+            this->regal_supported = true;
+            this->regal_pending.resize(epd_size);
+            break;
+        }
+    }
+}
 
 auto Display::discover_framebuffer() -> std::optional<std::string>
 {
@@ -148,71 +259,8 @@ Display::~Display()
 
 void Display::start()
 {
-#ifndef DRY_RUN
     this->set_power(true);
-    this->update_temperature();
-
-    if (
-        ioctl(
-            this->framebuffer_fd,
-            FBIOGET_VSCREENINFO,
-            &this->var_info
-        ) == -1
-    ) {
-        throw std::system_error(
-            errno,
-            std::generic_category(),
-            "Fetch display vscreeninfo"
-        );
-    }
-
-    if (
-        ioctl(
-            this->framebuffer_fd,
-            FBIOGET_FSCREENINFO,
-            &this->fix_info
-        ) == -1
-    ) {
-        throw std::system_error(
-            errno,
-            std::generic_category(),
-            "Fetch display fscreeninfo"
-        );
-    }
-
-    if (
-        this->var_info.xres != buf_width
-        || this->var_info.yres != buf_height
-        || this->var_info.xres_virtual != buf_width
-        || this->var_info.yres_virtual !=
-            buf_height * buf_total_frames
-        || this->fix_info.smem_len < buf_width * buf_height
-            * buf_total_frames * buf_depth
-    ) {
-        throw std::runtime_error("The framebuffer has invalid dimensions");
-    }
-
-    // Map the framebuffer to memory
-    void* mmap_res = mmap(
-        /* addr = */ nullptr,
-        /* len = */ this->fix_info.smem_len,
-        /* prot = */ PROT_READ | PROT_WRITE,
-        /* flags = */ MAP_SHARED,
-        /* fd = */ this->framebuffer_fd,
-        /* __offset = */ 0
-    );
-
-    if (mmap_res == MAP_FAILED)
-    {
-        throw std::system_error(
-            errno,
-            std::generic_category(),
-            "Map framebuffer to memory"
-        );
-    }
-
-    this->framebuffer = reinterpret_cast<std::uint8_t*>(mmap_res);
-#endif // DRY_RUN
+    this->temperature = this->read_temperature();
 
     // Initialize the null frame
     std::uint8_t* null_ptr = this->null_frame.data() + 2;
@@ -288,12 +336,13 @@ void Display::start()
         }
     }
 
-    // Reset all frames
-    for (std::size_t i = 0; i < buf_total_frames; ++i) {
-        this->reset_frame(i);
-    }
+    std::atomic_store(
+        &this->resolved_waveforms,
+        this->resolve_waveforms(this->temperature)
+    );
+
+    this->sink->start(this->null_frame);
 
-#ifndef DRY_RUN
     // Start the processing threads
     this->stopping_generator = false;
     this->generator_thread = std::thread(&Display::run_generator_thread, this);
@@ -302,7 +351,14 @@ void Display::start()
     this->stopping_vsync = false;
     this->vsync_thread = std::thread(&Display::run_vsync_thread, this);
     pthread_setname_np(this->vsync_thread.native_handle(), "waved_vsync");
-#endif // DRY_RUN
+
+    this->stopping_temperature = false;
+    this->temperature_thread = std::thread(
+        &Display::run_temperature_thread, this
+    );
+    pthread_setname_np(
+        this->temperature_thread.native_handle(), "waved_temperature"
+    );
 
     this->started = true;
 }
@@ -310,20 +366,31 @@ void Display::start()
 void Display::stop()
 {
     if (this->started) {
-#ifndef DRY_RUN
         // Wait for the current update to be processed then terminate
         this->stopping_generator = true;
         this->updates_cv.notify_one();
         this->generator_thread.join();
+        this->release_performance_hint();
 
         // Terminate the vsync thread
-        this->stopping_vsync = true;
+        {
+            std::lock_guard<std::mutex> lock(this->vsync_read_lock);
+            this->stopping_vsync = true;
+        }
+
+        this->vsync_can_read_cv.notify_one();
         this->vsync_thread.join();
 
-        if (this->framebuffer != nullptr) {
-            munmap(this->framebuffer, this->fix_info.smem_len);
+        // Terminate the temperature thread
+        {
+            std::lock_guard<std::mutex> lock(this->temperature_lock);
+            this->stopping_temperature = true;
         }
-#endif // DRY_RUN
+
+        this->temperature_cv.notify_one();
+        this->temperature_thread.join();
+
+        this->sink->stop();
 
         this->started = false;
     }
@@ -333,32 +400,43 @@ void Display::stop()
 
 void Display::set_power(bool power_state)
 {
-#ifndef DRY_RUN
     if (power_state != this->power_state) {
-        if (
-            ioctl(
-                this->framebuffer_fd, FBIOBLANK,
-                power_state ? fbioblank_on : fbioblank_off
-            ) == 0
-        ) {
+#ifdef ENABLE_PERF_REPORT
+        auto start = chrono::steady_clock::now();
+#endif // ENABLE_PERF_REPORT
+
+        if (this->sink->set_power(power_state)) {
             this->power_state = power_state;
+
+            if (power_state) {
+                ++this->power_ups;
+            } else {
+                ++this->power_downs;
+            }
+
+#ifdef ENABLE_PERF_REPORT
+            if (power_state) {
+                this->power_up_times = {start, chrono::steady_clock::now()};
+            }
+#endif // ENABLE_PERF_REPORT
         }
     }
-#endif // DRY_RUN
 }
 
-void Display::update_temperature()
+void Display::request_power()
 {
-#ifdef DRY_RUN
-    int result = 24;
-#else
-    if (
-        chrono::steady_clock::now() - this->temperature_last_read
-        <= temperature_read_interval
-    ) {
-        return;
+    if (!this->power_state) {
+        {
+            std::lock_guard<std::mutex> lock(this->vsync_read_lock);
+            this->power_requested = true;
+        }
+
+        this->vsync_can_read_cv.notify_one();
     }
+}
 
+int Display::read_temperature()
+{
     char buffer[12];
     ssize_t size = 0;
 
@@ -386,10 +464,84 @@ void Display::update_temperature()
         buffer[size] = '\0';
     }
 
-    int result = std::stoi(buffer);
-#endif // DRY_RUN
-    this->temperature = result;
-    this->temperature_last_read = chrono::steady_clock::now();
+    return std::stoi(buffer);
+}
+
+void Display::run_temperature_thread()
+{
+    // Sensor readings are not urgent, only run when nothing else needs to
+    sched_param param{};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    std::unique_lock<std::mutex> lock(this->temperature_lock);
+
+    while (!this->temperature_cv.wait_for(
+        lock, temperature_read_interval,
+        [this] { return this->stopping_temperature; }
+    )) {
+        try {
+            auto reading = this->read_temperature();
+
+            if (
+                std::abs(reading - this->temperature)
+                >= temperature_hysteresis
+            ) {
+                // When entering a new range, prepare all its waveforms here
+                // before switching, so that the generator never waits on it
+                auto current = std::atomic_load(&this->resolved_waveforms);
+                auto range = this->table.get_temperature_range(reading);
+
+                if (range != current->range) {
+                    std::atomic_store(
+                        &this->resolved_waveforms,
+                        this->resolve_waveforms(reading)
+                    );
+                }
+
+                this->temperature = reading;
+            }
+        } catch (const std::exception& err) {
+            // Don’t throw here, since we’re inside a background thread.
+            // Keep using the last reading until the sensor recovers
+            std::cerr << "Temperature: " << err.what() << '\n';
+        }
+    }
+}
+
+auto Display::resolve_waveforms(int temperature) const
+-> std::shared_ptr<const ResolvedWaveforms>
+{
+    auto result = std::make_shared<ResolvedWaveforms>();
+    auto mode_count = this->table.get_mode_count();
+    result->range = this->table.get_temperature_range(temperature);
+    result->waveforms.reserve(mode_count);
+    result->transitions.reserve(mode_count);
+
+    for (ModeID mode = 0; mode < mode_count; ++mode) {
+        const auto& waveform = this->table.lookup(mode, temperature);
+        result->waveforms.push_back(&waveform);
+        result->transitions.push_back(Waved::find_transitions(waveform));
+    }
+
+    return result;
+}
+
+bool Display::push_update(ModeKind mode, Region region, BufferView buffer)
+{
+    return this->push_update(this->find_mode(mode), region, buffer);
+}
+
+bool Display::push_update(ModeID mode, Region region, BufferView buffer)
+{
+    buffer.orientation = buffer.orientation.value_or(this->orientation);
+    auto layer = Display::make_layer(region, buffer);
+
+    if (!this->is_valid_mode(mode) || !layer) {
+        return false;
+    }
+
+    this->enqueue_update(mode, std::move(*layer));
+    return true;
 }
 
 bool Display::push_update(
@@ -398,7 +550,7 @@ bool Display::push_update(
     const std::vector<Intensity>& buffer
 )
 {
-    return this->push_update(this->table.get_mode_id(mode), region, buffer);
+    return this->push_update(this->find_mode(mode), region, buffer);
 }
 
 bool Display::push_update(
@@ -411,226 +563,1743 @@ bool Display::push_update(
         return false;
     }
 
-    // Transform from reMarkable coordinates to EPD coordinates:
-    // transpose to swap X and Y and flip X and Y
-    std::vector<Intensity> trans_buffer(buffer.size());
-
-    for (std::size_t k = 0; k < buffer.size(); ++k) {
-        std::size_t i = region.height - (k % region.height) - 1;
-        std::size_t j = region.width - (k / region.height) - 1;
-        trans_buffer[k] = buffer[i * region.width + j] & (intensity_values - 1);
-    }
+    return this->push_update(
+        mode, region,
+        BufferView{
+            buffer.data(), region.width,
+            PixelFormat::INTENSITY, 0, this->get_orientation()
+        }
+    );
+}
 
-    region = Region{
-        /* top = */ epd_height - region.left - region.width,
-        /* left = */ epd_width - region.top - region.height,
-        /* width = */ region.height,
-        /* height = */ region.width
-    };
+bool Display::push_update(
+    ModeKind mode,
+    Region region,
+    std::vector<Intensity>&& buffer
+)
+{
+    return this->push_update(
+        this->find_mode(mode), region, std::move(buffer)
+    );
+}
 
-    if (
-        region.left >= epd_width
-        || region.top >= epd_height
-        || region.left + region.width > epd_width
-        || region.top + region.height > epd_height
-    ) {
+bool Display::push_update(
+    ModeID mode,
+    Region region,
+    std::vector<Intensity>&& buffer
+)
+{
+    if (!this->is_valid_mode(mode)) {
         return false;
     }
 
-#ifndef DRY_RUN
-    std::lock_guard<std::mutex> lock(this->updates_lock);
-#endif // DRY_RUN
+    auto layer = Display::make_layer(
+        region, std::move(buffer), this->get_orientation()
+    );
 
-    this->pending_updates.emplace(Update{
-        {this->next_update_id++}
-        , mode
-        , region
-        , std::move(trans_buffer)
-#ifdef ENABLE_PERF_REPORT
-        , /* queue_time = */ chrono::steady_clock::now()
-        , /* dequeue_time = */ chrono::steady_clock::now()
-        , /* generate_times = */ {}
-        , /* vsync_times = */ {}
-#endif // ENABLE_PERF_REPORT
-    });
+    if (!layer) {
+        return false;
+    }
 
-#ifndef DRY_RUN
-    this->updates_cv.notify_one();
-#else
-    this->process_update();
-#endif // DRY_RUN
+    this->enqueue_update(mode, std::move(*layer));
     return true;
 }
 
-void Display::run_generator_thread()
+auto Display::make_layer(Region region, BufferView buffer)
+-> std::optional<Layer>
 {
-    while (!this->stopping_generator) {
-        this->process_update();
+    auto epd_region = Display::transform_region(region, *buffer.orientation);
+
+    if (!epd_region) {
+        return {};
+    }
+
+    Layer layer{*epd_region, buffer, {}};
+
+    if (!buffer.shared) {
+        // Pack the rows of the view into a buffer owned by the layer,
+        // keeping them in their original format
+        auto row_bytes = row_size(
+            buffer.format, buffer.pixel_offset + region.width
+        );
+        layer.storage.resize(row_bytes * region.height);
+
+        for (std::uint32_t y = 0; y < region.height; ++y) {
+            std::memcpy(
+                layer.storage.data() + y * row_bytes,
+                buffer.data + y * buffer.stride,
+                row_bytes
+            );
+        }
+
+        layer.source.data = layer.storage.data();
+        layer.source.stride = row_bytes;
     }
+
+    return layer;
 }
 
-void Display::process_update()
+auto Display::make_layer(
+    Region region,
+    std::vector<Intensity>&& buffer,
+    Orientation orientation
+) -> std::optional<Layer>
 {
-    if (this->pop_update()) {
-        this->align_update();
-        this->generate_frames();
-        this->commit_update();
+    auto epd_region = Display::transform_region(region, orientation);
+
+    if (!epd_region || buffer.size() != region.width * region.height) {
+        return {};
     }
+
+    // Moving the buffer into the layer keeps its data pointer valid
+    return Layer{
+        *epd_region,
+        BufferView{
+            buffer.data(), region.width,
+            PixelFormat::INTENSITY, 0, orientation
+        },
+        std::move(buffer)
+    };
 }
 
-bool Display::pop_update()
+bool Display::push_fill(ModeKind mode, Region region, Intensity intensity)
 {
-#ifdef DRY_RUN
-    if (this->pending_updates.empty()) {
-        return false;
-    }
-#else
-    std::unique_lock<std::mutex> lock(this->updates_lock);
-    this->updates_cv.wait(lock, [this] {
-        return !this->pending_updates.empty() || this->stopping_generator;
-    });
+    return this->push_fill(this->find_mode(mode), region, intensity);
+}
+
+bool Display::push_fill(ModeID mode, Region region, Intensity intensity)
+{
+    auto epd_region = Display::transform_region(
+        region, this->get_orientation()
+    );
 
-    if (this->stopping_generator) {
+    if (
+        !this->is_valid_mode(mode)
+        || !epd_region
+        || region.width == 0
+        || region.height == 0
+    ) {
         return false;
     }
-#endif // DRY_RUN
-
-    this->generate_update = std::move(this->pending_updates.front());
-    this->pending_updates.pop();
 
-    while (this->merge_update());
-
-#ifdef ENABLE_PERF_REPORT
-    this->generate_update.dequeue_time = chrono::steady_clock::now();
-#endif // ENABLE_PERF_REPORT
+    Layer layer{
+        *epd_region, {}, {},
+        static_cast<Intensity>(intensity & (intensity_values - 1))
+    };
+    this->enqueue_update(mode, std::move(layer));
     return true;
 }
 
-auto Display::merge_update() -> bool
+bool Display::push_copy(ModeKind mode, Region source, Point dest)
 {
-    if (this->pending_updates.empty()) {
+    return this->push_copy(this->find_mode(mode), source, dest);
+}
+
+bool Display::push_copy(ModeID mode, Region source, Point dest)
+{
+    auto orientation = this->get_orientation();
+    auto epd_source = Display::transform_region(source, orientation);
+    auto epd_dest = Display::transform_region(
+        Region{dest.top, dest.left, source.width, source.height},
+        orientation
+    );
+
+    if (
+        !this->is_valid_mode(mode)
+        || !epd_source
+        || !epd_dest
+        || source.width == 0
+        || source.height == 0
+    ) {
         return false;
     }
 
-    Update& cur_update = this->generate_update;
-    const Update& next_update = this->pending_updates.front();
+    // Orientations preserve distances, so the copy is a plain translation
+    // in EPD coordinates too
+    Layer layer{*epd_dest, {}, {}, {}, *epd_source};
+    this->enqueue_update(mode, std::move(layer));
+    return true;
+}
+
+bool Display::push_stroke(
+    ModeKind mode,
+    const std::vector<Point>& points,
+    std::uint32_t width,
+    Intensity color
+)
+{
+    return this->push_stroke(
+        this->find_mode(mode), points, width, color
+    );
+}
 
-    if (cur_update.mode != next_update.mode) {
+bool Display::push_stroke(
+    ModeID mode,
+    const std::vector<Point>& points,
+    std::uint32_t width,
+    Intensity color
+)
+{
+    if (
+        !this->is_valid_mode(mode)
+        || points.empty()
+        || width == 0
+    ) {
         return false;
     }
 
-    std::copy(
-        next_update.id.cbegin(), next_update.id.cend(),
-        std::back_inserter(cur_update.id)
-    );
+    auto orientation = this->get_orientation();
+    Stroke stroke{
+        {}, width, static_cast<Intensity>(color & (intensity_values - 1))
+    };
+    stroke.points.reserve(points.size());
 
-    auto top = std::min(cur_update.region.top, next_update.region.top);
-    auto left = std::min(cur_update.region.left, next_update.region.left);
-    auto width = std::max(
-        cur_update.region.left + cur_update.region.width,
-        next_update.region.left + next_update.region.width
-    ) - left;
-    auto height = std::max(
-        cur_update.region.top + cur_update.region.height,
-        next_update.region.top + next_update.region.height
-    ) - top;
+    for (const auto& point : points) {
+        auto epd_point = Display::transform_region(
+            Region{point.top, point.left, 1, 1}, orientation
+        );
 
-    Region merged_region{top, left, width, height};
+        if (!epd_point) {
+            return false;
+        }
 
-    // Create merged buffer with overlayed current intensities,
-    // current update and merged update
-    std::vector<Intensity> merged_buffer(width * height);
+        stroke.points.push_back(Point{epd_point->top, epd_point->left});
+    }
 
-    copy_rect(
-        /* source = */ this->current_intensity.data(),
-        /* source_region = */ merged_region,
-        /* source_width = */ epd_width,
-        /* dest = */ merged_buffer.data(),
-        /* dest_top = */ 0,
-        /* dest_left = */ 0,
-        /* dest_width = */ width
+    auto region = stroke_bounds(
+        stroke.points, width, Region{0, 0, epd_width, epd_height}
     );
 
-    copy_rect(
-        /* source = */ cur_update.buffer.data(),
-        /* source_region = */ Region{
-            0, 0,
-            cur_update.region.width, cur_update.region.height
-        },
-        /* source_width = */ cur_update.region.width,
-        /* dest = */ merged_buffer.data(),
-        /* dest_top = */ cur_update.region.top - merged_region.top,
-        /* dest_left = */ cur_update.region.left - merged_region.left,
-        /* dest_width = */ merged_region.width
-    );
+    Layer layer{region, {}, {}, {}, {}, std::move(stroke)};
 
+    if (!this->append_stroke(mode, layer)) {
+        this->enqueue_update(mode, std::move(layer));
+    }
+
+    return true;
+}
+
+auto Display::append_stroke(ModeID mode, Layer& layer) -> bool
+{
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    if (this->pending_updates.empty()) {
+        return false;
+    }
+
+    Update& update = this->pending_updates.back();
+
+    // Same exclusions as merge_update()
+    if (
+        update.mode != mode
+        || update.animation
+        || update.prepared
+        || update.priority != this->get_priority()
+        || update.refine
+        || update.refinement
+    ) {
+        return false;
+    }
+
+    update.id.push_back(this->next_update_id++);
+    update.region = merge_regions(update.region, layer.region);
+
+    auto& last = update.layers.back();
+    auto& stroke = *layer.stroke;
+
+    if (
+        last.stroke
+        && last.stroke->width == stroke.width
+        && last.stroke->color == stroke.color
+        && last.stroke->points.back().top == stroke.points.front().top
+        && last.stroke->points.back().left == stroke.points.front().left
+    ) {
+        // Continue the previous polyline
+        last.region = merge_regions(last.region, layer.region);
+        last.stroke->points.insert(
+            last.stroke->points.end(),
+            stroke.points.begin() + 1, stroke.points.end()
+        );
+    } else {
+        update.layers.emplace_back(std::move(layer));
+    }
+
+    this->track_arrival();
+    this->request_power();
+    return true;
+}
+
+auto Display::start_animation(Region region) -> std::optional<AnimationID>
+{
+    auto orientation = this->get_orientation();
+
+    if (
+        this->auto_modes.empty()
+        || !Display::transform_region(region, orientation)
+        || region.width == 0
+        || region.height == 0
+    ) {
+        return {};
+    }
+
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    auto animation = this->next_animation_id++;
+    this->animations.insert({animation, Animation{region, orientation}});
+    return animation;
+}
+
+bool Display::push_frame(AnimationID animation, BufferView buffer)
+{
+    auto session = this->find_animation(animation);
+
+    if (!session) {
+        return false;
+    }
+
+    buffer.orientation = session->orientation;
+    auto layer = Display::make_layer(session->region, buffer);
+
+    return layer && this->enqueue_update(
+        auto_mode, std::move(*layer), animation
+    );
+}
+
+bool Display::push_frame(
+    AnimationID animation,
+    const std::vector<Intensity>& buffer
+)
+{
+    auto session = this->find_animation(animation);
+
+    if (
+        !session
+        || buffer.size() != session->region.width * session->region.height
+    ) {
+        return false;
+    }
+
+    return this->push_frame(
+        animation,
+        BufferView{buffer.data(), session->region.width}
+    );
+}
+
+bool Display::push_frame(
+    AnimationID animation,
+    std::vector<Intensity>&& buffer
+)
+{
+    auto session = this->find_animation(animation);
+
+    if (!session) {
+        return false;
+    }
+
+    auto layer = Display::make_layer(
+        session->region, std::move(buffer), session->orientation
+    );
+
+    return layer && this->enqueue_update(
+        auto_mode, std::move(*layer), animation
+    );
+}
+
+auto Display::get_dropped_frames(AnimationID animation) -> std::size_t
+{
+    auto session = this->find_animation(animation);
+    return session ? session->dropped : 0;
+}
+
+auto Display::stop_animation(AnimationID animation) -> std::size_t
+{
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    auto it = this->animations.find(animation);
+
+    if (it == this->animations.end()) {
+        return 0;
+    }
+
+    auto dropped = it->second.dropped;
+    this->animations.erase(it);
+    return dropped;
+}
+
+auto Display::find_animation(AnimationID animation)
+-> std::optional<Animation>
+{
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    auto it = this->animations.find(animation);
+
+    if (it == this->animations.end()) {
+        return {};
+    }
+
+    return it->second;
+}
+
+auto Display::prepare_update(ModeKind mode, Region region, BufferView buffer)
+-> std::optional<PreparedID>
+{
+    return this->prepare_update(
+        this->find_mode(mode), region, buffer
+    );
+}
+
+auto Display::prepare_update(ModeID mode, Region region, BufferView buffer)
+-> std::optional<PreparedID>
+{
+    buffer.orientation = buffer.orientation.value_or(this->orientation);
+    auto layer = Display::make_layer(region, buffer);
+
+    if (!this->is_valid_mode(mode) || !layer) {
+        return {};
+    }
+
+    return this->enqueue_prepared(mode, std::move(*layer));
+}
+
+auto Display::prepare_update(
+    ModeKind mode,
+    Region region,
+    std::vector<Intensity>&& buffer
+) -> std::optional<PreparedID>
+{
+    return this->prepare_update(
+        this->find_mode(mode), region, std::move(buffer)
+    );
+}
+
+auto Display::prepare_update(
+    ModeID mode,
+    Region region,
+    std::vector<Intensity>&& buffer
+) -> std::optional<PreparedID>
+{
+    if (!this->is_valid_mode(mode)) {
+        return {};
+    }
+
+    auto layer = Display::make_layer(
+        region, std::move(buffer), this->get_orientation()
+    );
+
+    if (!layer) {
+        return {};
+    }
+
+    return this->enqueue_prepared(mode, std::move(*layer));
+}
+
+bool Display::commit(PreparedID prepared)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->updates_lock);
+
+        auto it = this->prepared_updates.find(prepared);
+
+        if (it == this->prepared_updates.end() || it->second.committed) {
+            return false;
+        }
+
+        if (it->second.generating) {
+            // Pushed by the generator thread once its frames are ready
+            it->second.committed = true;
+            return true;
+        }
+
+        auto& unprepared = this->unprepared_updates;
+        unprepared.erase(
+            std::remove(unprepared.begin(), unprepared.end(), prepared),
+            unprepared.end()
+        );
+
+        this->queue_prepared(std::move(it->second.update));
+        this->prepared_updates.erase(it);
+    }
+
+    this->updates_cv.notify_one();
+    this->request_power();
+    return true;
+}
+
+void Display::discard(PreparedID prepared)
+{
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    auto it = this->prepared_updates.find(prepared);
+
+    if (it == this->prepared_updates.end() || it->second.committed) {
+        return;
+    }
+
+    if (it->second.generating) {
+        it->second.discarded = true;
+        return;
+    }
+
+    auto& unprepared = this->unprepared_updates;
+    unprepared.erase(
+        std::remove(unprepared.begin(), unprepared.end(), prepared),
+        unprepared.end()
+    );
+    this->prepared_updates.erase(it);
+}
+
+bool Display::push_preview(ModeKind mode, Region region, BufferView buffer)
+{
+    return this->push_preview(this->find_mode(mode), region, buffer);
+}
+
+bool Display::push_preview(ModeID mode, Region region, BufferView buffer)
+{
+    buffer.orientation = buffer.orientation.value_or(this->orientation);
+    auto layer = Display::make_layer(region, buffer);
+
+    if (!this->is_valid_mode(mode) || this->auto_modes.empty() || !layer) {
+        return false;
+    }
+
+    this->enqueue_update(auto_mode, std::move(*layer), {}, mode);
+    return true;
+}
+
+bool Display::push_preview(
+    ModeKind mode,
+    Region region,
+    std::vector<Intensity>&& buffer
+)
+{
+    return this->push_preview(
+        this->find_mode(mode), region, std::move(buffer)
+    );
+}
+
+bool Display::push_preview(
+    ModeID mode,
+    Region region,
+    std::vector<Intensity>&& buffer
+)
+{
+    if (!this->is_valid_mode(mode) || this->auto_modes.empty()) {
+        return false;
+    }
+
+    auto layer = Display::make_layer(
+        region, std::move(buffer), this->get_orientation()
+    );
+
+    if (!layer) {
+        return false;
+    }
+
+    this->enqueue_update(auto_mode, std::move(*layer), {}, mode);
+    return true;
+}
+
+bool Display::set_cleanup(ModeKind mode, std::uint32_t threshold)
+{
+    return this->set_cleanup(this->find_mode(mode), threshold);
+}
+
+bool Display::set_cleanup(ModeID mode, std::uint32_t threshold)
+{
+    if (mode >= this->table.get_mode_count()) {
+        return false;
+    }
+
+    auto kind = this->table.get_mode_kind(mode);
+
+    if (kind != ModeKind::GC16 && kind != ModeKind::GLR16) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    this->cleanup_mode = mode;
+    this->cleanup_threshold = threshold;
+    return true;
+}
+
+auto Display::find_mode(ModeKind mode) const -> ModeID
+{
+    if (mode == ModeKind::AUTO) {
+        return auto_mode;
+    }
+
+    return this->table.get_mode_id(mode);
+}
+
+bool Display::is_valid_mode(ModeID mode) const
+{
+    return mode < this->table.get_mode_count()
+        || (mode == auto_mode && !this->auto_modes.empty());
+}
+
+bool Display::is_binary_mode(ModeID mode) const
+{
+    if (mode == auto_mode) {
+        return false;
+    }
+
+    auto kind = this->table.get_mode_kind(mode);
+    return kind == ModeKind::A2
+        || kind == ModeKind::DU
+        || kind == ModeKind::A2_TRIMMED
+        || kind == ModeKind::DU_TRIMMED;
+}
+
+void Display::set_orientation(Orientation orientation)
+{
+    this->orientation = orientation;
+}
+
+auto Display::get_orientation() const -> Orientation
+{
+    return this->orientation;
+}
+
+void Display::set_priority(Priority priority)
+{
+    this->priority = priority;
+}
+
+auto Display::get_priority() const -> Priority
+{
+    return this->priority;
+}
+
+void Display::set_latency_target(
+    Priority priority,
+    chrono::milliseconds target
+)
+{
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    this->latency_targets[static_cast<std::size_t>(priority)] = target;
+}
+
+void Display::set_power_off_timeout(chrono::milliseconds timeout)
+{
+    this->fixed_power_off_timeout = timeout;
+}
+
+auto Display::get_power_off_timeout() const -> chrono::milliseconds
+{
+    auto timeout = this->fixed_power_off_timeout.load();
+
+    if (timeout.count() > 0) {
+        return timeout;
+    }
+
+    return this->adaptive_power_off_timeout;
+}
+
+auto Display::get_power_ups() const -> std::size_t
+{
+    return this->power_ups;
+}
+
+auto Display::get_power_downs() const -> std::size_t
+{
+    return this->power_downs;
+}
+
+void Display::set_performance_hint(std::string path, std::string value)
+{
+    std::lock_guard<std::mutex> lock(this->performance_hint_lock);
+    this->performance_hint_path = std::move(path);
+    this->performance_hint_value = std::move(value);
+}
+
+void Display::raise_performance_hint()
+{
+    if (this->performance_hint_fd) {
+        return;
+    }
+
+    std::string path;
+    std::string value;
+
+    {
+        std::lock_guard<std::mutex> lock(this->performance_hint_lock);
+        path = this->performance_hint_path;
+        value = this->performance_hint_value;
+    }
+
+    if (path.empty()) {
+        return;
+    }
+
+    try {
+        FileDescriptor fd(path.c_str(), O_RDWR);
+        char buffer[64];
+        auto size = pread(fd, buffer, sizeof(buffer), 0);
+        this->performance_hint_previous.assign(buffer, std::max<ssize_t>(size, 0));
+        write_contents(fd, value);
+        this->performance_hint_fd = std::move(fd);
+    } catch (const std::exception& err) {
+        // Don’t throw here, since we’re inside the generator thread.
+        // Stop trying until a working hint is set
+        std::cerr << "Performance hint: " << err.what() << '\n';
+        std::lock_guard<std::mutex> lock(this->performance_hint_lock);
+
+        if (this->performance_hint_path == path) {
+            this->performance_hint_path.clear();
+        }
+    }
+}
+
+void Display::release_performance_hint()
+{
+    if (!this->performance_hint_fd) {
+        return;
+    }
+
+    try {
+        if (!this->performance_hint_previous.empty()) {
+            write_contents(
+                *this->performance_hint_fd,
+                this->performance_hint_previous
+            );
+        }
+    } catch (const std::exception& err) {
+        std::cerr << "Performance hint: " << err.what() << '\n';
+    }
+
+    this->performance_hint_fd.reset();
+}
+
+void Display::track_arrival()
+{
+    auto now = chrono::steady_clock::now();
+    auto last = std::exchange(this->last_arrival, now);
+
+    if (last == chrono::steady_clock::time_point{}) {
+        return;
+    }
+
+    auto gap = chrono::duration_cast<chrono::milliseconds>(now - last);
+
+    if (gap < burst_gap) {
+        return;
+    }
+
+    if (gap > this->adaptive_power_off_timeout.load()) {
+        // The controller was already off when this update came, so updates
+        // are getting rarer: move back towards the shortest timeout
+        this->average_gap = (3 * this->average_gap + min_power_off_timeout) / 4;
+    } else {
+        this->average_gap = (3 * this->average_gap + gap) / 4;
+    }
+
+    // Stay powered slightly longer than the usual gap, so that the next
+    // update in the current pace finds the controller on
+    this->adaptive_power_off_timeout = std::clamp(
+        this->average_gap * 5 / 4,
+        min_power_off_timeout,
+        max_power_off_timeout
+    );
+}
+
+auto Display::transform_region(Region region, Orientation orientation)
+-> std::optional<Region>
+{
+    // Screen size in the given orientation
+    auto width = swaps_axes(orientation) ? epd_height : epd_width;
+    auto height = swaps_axes(orientation) ? epd_width : epd_height;
+
+    if (
+        region.left >= width
+        || region.top >= height
+        || region.width > width - region.left
+        || region.height > height - region.top
+    ) {
+        return {};
+    }
+
+    switch (orientation) {
+    case Orientation::ROTATE_0:
+        // Swap X and Y, flip X and Y
+        return Region{
+            /* top = */ epd_height - region.left - region.width,
+            /* left = */ epd_width - region.top - region.height,
+            /* width = */ region.height,
+            /* height = */ region.width
+        };
+
+    case Orientation::ROTATE_90:
+        // Flip X
+        return Region{
+            /* top = */ region.top,
+            /* left = */ epd_width - region.left - region.width,
+            /* width = */ region.width,
+            /* height = */ region.height
+        };
+
+    case Orientation::ROTATE_180:
+        // Swap X and Y
+        return Region{
+            /* top = */ region.left,
+            /* left = */ region.top,
+            /* width = */ region.height,
+            /* height = */ region.width
+        };
+
+    case Orientation::ROTATE_270:
+        // Flip Y
+        return Region{
+            /* top = */ epd_height - region.top - region.height,
+            /* left = */ region.left,
+            /* width = */ region.width,
+            /* height = */ region.height
+        };
+
+    case Orientation::EPD:
+        return region;
+    }
+
+    return {};
+}
+
+bool Display::enqueue_update(
+    ModeID mode,
+    Layer&& layer,
+    std::optional<AnimationID> animation,
+    std::optional<ModeID> refine
+)
+{
+    Update update{
+        {}
+        , mode
+        , layer.region
+        , {}
+        , {}
+        , {}
+        , animation
+        , {}
+        , refine
+        , /* refinement = */ false
+        , this->get_priority()
+        , /* degraded = */ false
+        , /* queue_time = */ chrono::steady_clock::now()
+#ifdef ENABLE_PERF_REPORT
+        , /* dequeue_time = */ chrono::steady_clock::now()
+        , /* generate_times = */ {}
+        , /* vsync_times = */ {}
+        , /* power_times = */ {}
+        , /* hinted = */ false
+#endif // ENABLE_PERF_REPORT
+    };
+
+    update.layers.emplace_back(std::move(layer));
+
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    if (animation) {
+        auto session = this->animations.find(*animation);
+
+        if (session == this->animations.end()) {
+            return false;
+        }
+
+        for (auto& pending : this->pending_updates) {
+            if (pending.animation == animation) {
+                // Replace the stale frame, keeping its place in the queue
+                pending.id.push_back(this->next_update_id++);
+                pending.region = update.region;
+                pending.layers = std::move(update.layers);
+                ++session->second.dropped;
+                return true;
+            }
+        }
+    }
+
+    const auto& first = update.layers.front();
+
+    if (!first.copy && !first.stroke) {
+        // Refine passes are pointless if their region gets replaced
+        auto& pending = this->pending_updates;
+        pending.erase(
+            std::remove_if(
+                pending.begin(), pending.end(),
+                [&update](const Update& other) {
+                    return other.refinement
+                        && contains_region(update.region, other.region);
+                }
+            ),
+            pending.end()
+        );
+    }
+
+    update.id.push_back(this->next_update_id++);
+    this->pending_updates.emplace_back(std::move(update));
+    this->track_arrival();
+
+    this->updates_cv.notify_one();
+    this->request_power();
+    return true;
+}
+
+auto Display::enqueue_prepared(ModeID mode, Layer&& layer)
+-> std::optional<PreparedID>
+{
+    Update update{
+        {}
+        , mode
+        , layer.region
+        , {}
+        , {}
+        , {}
+        , {}
+        , {}
+        , {}
+        , /* refinement = */ false
+        , this->get_priority()
+        , /* degraded = */ false
+        , /* queue_time = */ chrono::steady_clock::now()
+#ifdef ENABLE_PERF_REPORT
+        , /* dequeue_time = */ chrono::steady_clock::now()
+        , /* generate_times = */ {}
+        , /* vsync_times = */ {}
+        , /* power_times = */ {}
+        , /* hinted = */ false
+#endif // ENABLE_PERF_REPORT
+    };
+
+    update.layers.emplace_back(std::move(layer));
+    PreparedID prepared;
+
+    {
+        std::lock_guard<std::mutex> lock(this->updates_lock);
+
+        prepared = this->next_prepared_id++;
+        this->prepared_updates.insert({prepared, Prepared{std::move(update)}});
+        this->unprepared_updates.push_back(prepared);
+    }
+
+    this->updates_cv.notify_one();
+    return prepared;
+}
+
+auto Display::pop_prepared() -> std::optional<PreparedID>
+{
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+
+    if (this->unprepared_updates.empty() || this->stopping_generator) {
+        return {};
+    }
+
+    auto prepared = this->unprepared_updates.front();
+    this->unprepared_updates.pop_front();
+
+    auto& entry = this->prepared_updates.at(prepared);
+    entry.generating = true;
+    this->generate_update = std::move(entry.update);
+    return prepared;
+}
+
+void Display::store_prepared(PreparedID prepared, ModeID requested_mode)
+{
+    auto& update = this->generate_update;
+    const auto& region = update.region;
+    auto frames = std::make_shared<PreparedFrames>();
+
+    // Keep the intensities against which the frames were generated
+    frames->expected.resize(region.width * region.height);
     copy_rect(
-        /* source = */ next_update.buffer.data(),
-        /* source_region = */ Region{
-            0, 0,
-            next_update.region.width, next_update.region.height
-        },
-        /* source_width = */ next_update.region.width,
-        /* dest = */ merged_buffer.data(),
-        /* dest_top = */ next_update.region.top - merged_region.top,
-        /* dest_left = */ next_update.region.left - merged_region.left,
-        /* dest_width = */ merged_region.width
+        /* source = */ this->current_intensity.data(),
+        /* source_region = */ region,
+        /* source_width = */ epd_width,
+        /* dest = */ frames->expected.data(),
+        /* dest_top = */ 0,
+        /* dest_left = */ 0,
+        /* dest_width = */ region.width
+    );
+
+    if (
+        this->regal_supported
+        && this->table.get_mode_kind(update.mode) == ModeKind::GLR16
+    ) {
+        // Regal targets also depend on the cells pending cleaning
+        frames->expected_regal.reserve(region.width * region.height);
+
+        for (std::size_t y = 0; y < region.height; ++y) {
+            auto pending = this->regal_pending.cbegin()
+                + (region.top + y) * epd_width + region.left;
+            frames->expected_regal.insert(
+                frames->expected_regal.end(), pending, pending + region.width
+            );
+        }
+    }
+
+    frames->waveform = this->generate_waveform;
+    frames->mode = requested_mode;
+
+    // Only keep the phase bytes covering the region
+    const std::size_t groups = region.width / buf_actual_depth;
+
+    for (const auto& frame : this->generate_buffer) {
+        std::vector<std::uint8_t> bytes(2 * groups * region.height);
+        std::uint8_t* dest = bytes.data();
+        const std::uint8_t* data = frame.data()
+            + (margin_top + region.top) * buf_stride
+            + (margin_left + region.left / buf_actual_depth) * buf_depth;
+
+        for (std::size_t y = 0; y < region.height; ++y) {
+            for (std::size_t x = 0; x < groups; ++x) {
+                *dest++ = data[x * buf_depth];
+                *dest++ = data[x * buf_depth + 1];
+            }
+
+            data += buf_stride;
+        }
+
+        frames->frames.emplace_back(std::move(bytes));
+    }
+
+    update.prepared = std::move(frames);
+    bool queued = false;
+
+    {
+        std::lock_guard<std::mutex> lock(this->updates_lock);
+
+        auto it = this->prepared_updates.find(prepared);
+        auto& entry = it->second;
+        entry.generating = false;
+
+        if (entry.discarded) {
+            this->prepared_updates.erase(it);
+        } else if (entry.committed) {
+            this->queue_prepared(std::move(update));
+            this->prepared_updates.erase(it);
+            queued = true;
+        } else {
+            entry.update = std::move(update);
+        }
+    }
+
+    if (queued) {
+        this->updates_cv.notify_one();
+        this->request_power();
+    }
+}
+
+void Display::queue_prepared(Update&& update)
+{
+    update.queue_time = chrono::steady_clock::now();
+    update.id.push_back(this->next_update_id++);
+    this->pending_updates.emplace_back(std::move(update));
+    this->track_arrival();
+}
+
+auto Display::restore_prepared() -> bool
+{
+    auto& update = this->generate_update;
+    const auto& region = update.region;
+    const auto& frames = *update.prepared;
+    const Waveform& waveform
+        = *this->generate_waveforms->waveforms[update.mode];
+
+    if (&waveform != frames.waveform) {
+        return false;
+    }
+
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* expected = frames.expected.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        if (!std::equal(prev, prev + region.width, expected)) {
+            return false;
+        }
+
+        prev += epd_width;
+        expected += region.width;
+    }
+
+    if (!frames.expected_regal.empty()) {
+        auto expected_regal = frames.expected_regal.cbegin();
+
+        for (std::size_t y = 0; y < region.height; ++y) {
+            auto pending = this->regal_pending.cbegin()
+                + (region.top + y) * epd_width + region.left;
+
+            if (!std::equal(pending, pending + region.width, expected_regal)) {
+                return false;
+            }
+
+            expected_regal += region.width;
+        }
+    }
+
+    update.layers.clear();
+
+#ifdef ENABLE_PERF_REPORT
+    update.generate_times.resize(frames.frames.size() + 1);
+    update.generate_times[0] = chrono::steady_clock::now();
+#endif // ENABLE_PERF_REPORT
+
+    const std::size_t groups = region.width / buf_actual_depth;
+    this->generate_buffer.clear();
+    this->generate_buffer.reserve(frames.frames.size());
+
+    for (std::size_t k = 0; k < frames.frames.size(); ++k) {
+        this->generate_buffer.emplace_back(this->null_frame);
+        std::uint8_t* data = this->generate_buffer.back().data()
+            + (margin_top + region.top) * buf_stride
+            + (margin_left + region.left / buf_actual_depth) * buf_depth;
+        const std::uint8_t* bytes = frames.frames[k].data();
+
+        for (std::size_t y = 0; y < region.height; ++y) {
+            for (std::size_t x = 0; x < groups; ++x) {
+                data[x * buf_depth] = *bytes++;
+                data[x * buf_depth + 1] = *bytes++;
+            }
+
+            data += buf_stride;
+        }
+
+#ifdef ENABLE_PERF_REPORT
+        update.generate_times[k + 1] = chrono::steady_clock::now();
+#endif // ENABLE_PERF_REPORT
+    }
+
+    return true;
+}
+
+void Display::run_generator_thread()
+{
+    while (!this->stopping_generator) {
+        this->process_update();
+    }
+}
+
+void Display::process_update()
+{
+    if (this->pop_update()) {
+        this->generate_waveforms = std::atomic_load(&this->resolved_waveforms);
+        this->raise_performance_hint();
+
+#ifdef ENABLE_PERF_REPORT
+        this->generate_update.hinted = this->performance_hint_fd.has_value();
+#endif // ENABLE_PERF_REPORT
+
+        if (!this->generate_update.prepared) {
+            this->build_update();
+            this->generate_frames();
+        } else if (!this->restore_prepared()) {
+            // Contents changed since the update was prepared, render it
+            // again against the current intensities
+            auto& update = this->generate_update;
+            update.mode = update.prepared->mode;
+            update.fill.reset();
+            this->render_update();
+            this->select_mode();
+            this->apply_regal();
+            this->generate_frames();
+        }
+
+        this->send_frames();
+        this->commit_update();
+    } else if (auto prepared = this->pop_prepared()) {
+        this->generate_waveforms = std::atomic_load(&this->resolved_waveforms);
+        this->raise_performance_hint();
+
+        // Render from borrowed layers, so that the update can be rendered
+        // again if the screen changes before it is committed
+        auto& update = this->generate_update;
+        auto mode = update.mode;
+        auto layers = std::move(update.layers);
+
+        for (const auto& layer : layers) {
+            update.layers.push_back(Layer{
+                layer.region, layer.source, {},
+                layer.fill, layer.copy, layer.stroke
+            });
+        }
+
+        this->build_update();
+        this->generate_frames();
+        update.layers = std::move(layers);
+        this->store_prepared(*prepared, mode);
+    }
+}
+
+void Display::build_update()
+{
+    const auto requested = this->generate_update.region;
+    this->align_update();
+    this->render_update();
+
+    this->split_preview(requested);
+    this->select_mode();
+    this->degrade_mode();
+    this->apply_regal();
+}
+
+bool Display::pop_update()
+{
+    std::unique_lock<std::mutex> lock(this->updates_lock);
+    const auto pred = [this] {
+        return !this->pending_updates.empty()
+            || !this->unprepared_updates.empty()
+            || this->stopping_generator;
+    };
+
+    if (!pred() && this->performance_hint_fd) {
+        // The burst is over, let the CPU slow down while waiting
+        lock.unlock();
+        this->release_performance_hint();
+        lock.lock();
+    }
+
+    if (this->cleanup_threshold > 0 && this->find_worn_tiles()) {
+        // Clean up worn tiles once updates stop coming, then go through
+        // the remaining ones without waiting again
+        auto delay = this->cleaning ? chrono::milliseconds{0} : cleanup_delay;
+
+        if (!this->updates_cv.wait_for(lock, delay, pred)) {
+            return this->pop_cleanup();
+        }
+    } else {
+        this->updates_cv.wait(lock, pred);
+    }
+
+    this->cleaning = false;
+
+    if (this->stopping_generator || this->pending_updates.empty()) {
+        return false;
+    }
+
+    // Let updates of a higher priority class overtake the ones queued
+    // before them, as long as they do not depend on each other
+    auto& pending = this->pending_updates;
+    auto next = pending.begin();
+
+    for (auto it = std::next(next); it != pending.end(); ++it) {
+        if (
+            it->priority < next->priority
+            && !it->layers.front().copy
+            && std::none_of(pending.begin(), it, [&it](const Update& other) {
+                const auto& copy = other.layers.front().copy;
+                return intersect_regions(other.region, it->region)
+                    || (copy && intersect_regions(*copy, it->region));
+            })
+        ) {
+            next = it;
+        }
+    }
+
+    this->generate_update = std::move(*next);
+    pending.erase(next);
+
+    while (this->merge_update());
+
+    auto& update = this->generate_update;
+    auto target = this->latency_targets[
+        static_cast<std::size_t>(update.priority)
+    ];
+    // Downgraded updates rely on the clean-up pass to fix their contents
+    update.degraded = (
+        !update.prepared
+        && !update.refinement
+        && target.count() > 0
+        && this->cleanup_threshold > 0
+        && chrono::steady_clock::now() - update.queue_time > target
+    );
+
+#ifdef ENABLE_PERF_REPORT
+    update.dequeue_time = chrono::steady_clock::now();
+#endif // ENABLE_PERF_REPORT
+    return true;
+}
+
+auto Display::find_worn_tiles() const -> std::optional<Region>
+{
+    const auto worn = [this](std::uint32_t x, std::uint32_t y) {
+        return this->tile_wear[y * cleanup_tiles_x + x]
+            >= this->cleanup_threshold;
+    };
+
+    for (std::uint32_t top = 0; top < cleanup_tiles_y; ++top) {
+        for (std::uint32_t left = 0; left < cleanup_tiles_x; ++left) {
+            if (!worn(left, top)) {
+                continue;
+            }
+
+            // Grow the rectangle to the right, then downwards while the
+            // whole row of tiles is worn
+            auto right = left + 1;
+
+            while (right < cleanup_tiles_x && worn(right, top)) {
+                ++right;
+            }
+
+            auto bottom = top + 1;
+
+            while (
+                bottom < cleanup_tiles_y
+                && std::all_of(
+                    this->tile_wear.cbegin() + bottom * cleanup_tiles_x + left,
+                    this->tile_wear.cbegin() + bottom * cleanup_tiles_x + right,
+                    [this](std::uint32_t wear) {
+                        return wear >= this->cleanup_threshold;
+                    }
+                )
+            ) {
+                ++bottom;
+            }
+
+            return Region{
+                /* top = */ top * cleanup_tile_size,
+                /* left = */ left * cleanup_tile_size,
+                /* width = */ std::min(right * cleanup_tile_size, epd_width)
+                    - left * cleanup_tile_size,
+                /* height = */ std::min(bottom * cleanup_tile_size, epd_height)
+                    - top * cleanup_tile_size,
+            };
+        }
+    }
+
+    return {};
+}
+
+bool Display::pop_cleanup()
+{
+    auto region = this->find_worn_tiles();
+
+    if (!region) {
+        return false;
+    }
+
+    Update update{
+        {}
+        , this->cleanup_mode
+        , *region
+        , {}
+        , {}
+        , {}
+        , {}
+        , {}
+        , {}
+        , /* refinement = */ false
+        , Priority::LOW
+        , /* degraded = */ false
+        , /* queue_time = */ chrono::steady_clock::now()
+#ifdef ENABLE_PERF_REPORT
+        , /* dequeue_time = */ chrono::steady_clock::now()
+        , /* generate_times = */ {}
+        , /* vsync_times = */ {}
+        , /* power_times = */ {}
+        , /* hinted = */ false
+#endif // ENABLE_PERF_REPORT
+    };
+
+    // Redraw the current contents of the tiles onto themselves
+    update.layers.push_back(Layer{*region, {}, {}, {}, *region, {}});
+    update.id.push_back(this->next_update_id++);
+
+    this->generate_update = std::move(update);
+    this->cleaning = true;
+    return true;
+}
+
+auto Display::merge_update() -> bool
+{
+    if (this->pending_updates.empty()) {
+        return false;
+    }
+
+    Update& cur_update = this->generate_update;
+    Update& next_update = this->pending_updates.front();
+
+    if (
+        cur_update.mode != next_update.mode
+        || next_update.layers.front().copy
+        || cur_update.animation
+        || next_update.animation
+        || cur_update.prepared
+        || next_update.prepared
+        || cur_update.priority != next_update.priority
+        || cur_update.refine
+        || next_update.refine
+        || cur_update.refinement
+        || next_update.refinement
+    ) {
+        return false;
+    }
+
+    std::copy(
+        next_update.id.cbegin(), next_update.id.cend(),
+        std::back_inserter(cur_update.id)
+    );
+
+    cur_update.region = merge_regions(cur_update.region, next_update.region);
+    std::move(
+        next_update.layers.begin(), next_update.layers.end(),
+        std::back_inserter(cur_update.layers)
+    );
+
+    this->pending_updates.pop_front();
+    return true;
+}
+
+void Display::align_update()
+{
+    constexpr auto mask = buf_actual_depth - 1;
+    auto& region = this->generate_update.region;
+
+    auto aligned_left = region.left & ~mask;
+    auto pad_left = region.left & mask;
+    auto new_width = (pad_left + region.width + mask) & ~mask;
+
+    region.left = aligned_left;
+    region.width = new_width;
+}
+
+void Display::render_update()
+{
+    auto& update = this->generate_update;
+    const auto& region = update.region;
+
+    auto& first = update.layers.front();
+    const auto dither = [&update, this](const Region& layer_region) {
+        return this->is_binary_mode(update.mode)
+            ? std::optional<Point>{Point{layer_region.top, layer_region.left}}
+            : std::nullopt;
+    };
+    bool covered = (
+        !first.stroke
+        && first.region.top == region.top
+        && first.region.left == region.left
+        && first.region.width == region.width
+        && first.region.height == region.height
+    );
+
+    if (covered && update.layers.size() == 1 && first.fill) {
+        // Frames for a covering fill are generated without a buffer
+        update.fill = first.fill;
+        update.layers.clear();
+        return;
+    }
+
+    if (
+        covered
+        && update.layers.size() == 1
+        && !first.fill
+        && !first.copy
+        && *first.source.orientation == Orientation::EPD
+        && first.source.format == PixelFormat::INTENSITY
+        && first.source.pixel_offset == 0
+        && first.source.data == first.storage.data()
+        && first.source.stride == region.width
+    ) {
+        // Owned buffers that are already in EPD coordinates only need
+        // to be truncated in place
+        transform_to_epd(
+            first.source, region.width, region.height,
+            first.storage.data(), region.width, dither(region)
+        );
+
+        update.buffer = std::move(first.storage);
+        update.layers.clear();
+        return;
+    }
+
+    std::vector<Intensity> buffer(region.width * region.height);
+
+    if (!covered) {
+        // Start from the current intensities
+        copy_rect(
+            /* source = */ this->current_intensity.data(),
+            /* source_region = */ region,
+            /* source_width = */ epd_width,
+            /* dest = */ buffer.data(),
+            /* dest_top = */ 0,
+            /* dest_left = */ 0,
+            /* dest_width = */ region.width
+        );
+    }
+
+    for (const auto& layer : update.layers) {
+        Intensity* dest = buffer.data()
+            + (layer.region.top - region.top) * region.width
+            + (layer.region.left - region.left);
+
+        if (layer.fill) {
+            for (std::uint32_t y = 0; y < layer.region.height; ++y) {
+                std::fill(dest, dest + layer.region.width, *layer.fill);
+                dest += region.width;
+            }
+
+            continue;
+        }
+
+        if (layer.stroke) {
+            draw_stroke(
+                layer.stroke->points, layer.stroke->width,
+                layer.stroke->color, dest, layer.region, region.width
+            );
+            continue;
+        }
+
+        if (layer.copy) {
+            copy_rect(
+                /* source = */ this->current_intensity.data(),
+                /* source_region = */ *layer.copy,
+                /* source_width = */ epd_width,
+                /* dest = */ dest,
+                /* dest_top = */ 0,
+                /* dest_left = */ 0,
+                /* dest_width = */ region.width
+            );
+            continue;
+        }
+
+        auto orientation = *layer.source.orientation;
+        bool swap = swaps_axes(orientation);
+
+        transform_to_epd(
+            layer.source,
+            swap ? layer.region.height : layer.region.width,
+            swap ? layer.region.width : layer.region.height,
+            dest, region.width, dither(layer.region)
+        );
+    }
+
+    update.layers.clear();
+    update.buffer = std::move(buffer);
+}
+
+auto Display::find_transitions() const -> TransitionSet
+{
+    const auto& update = this->generate_update;
+    const auto& region = update.region;
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+    TransitionSet result{};
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < region.width; ++x) {
+            result[prev[x]][update.fill ? *update.fill : *next++] = true;
+        }
+
+        prev += epd_width;
+    }
+
+    return result;
+}
+
+auto Display::find_fastest_mode(const std::vector<ModeID>& modes) const
+-> std::optional<ModeID>
+{
+    const auto transitions = this->find_transitions();
+    const auto& resolved = *this->generate_waveforms;
+
+    // Sort candidates by increasing duration
+    std::vector<std::pair<std::size_t, ModeID>> candidates;
+
+    for (auto mode : modes) {
+        candidates.emplace_back(resolved.waveforms[mode]->size(), mode);
+    }
+
+    std::stable_sort(
+        candidates.begin(), candidates.end(),
+        [](const auto& a, const auto& b) { return a.first < b.first; }
     );
 
-    cur_update.region = std::move(merged_region);
-    cur_update.buffer = std::move(merged_buffer);
+    for (const auto& [length, mode] : candidates) {
+        const auto& driven = resolved.transitions[mode];
+        bool supported = true;
 
-    this->pending_updates.pop();
-    return true;
+        for (Intensity from = 0; from < intensity_values && supported; ++from) {
+            for (Intensity to = 0; to < intensity_values; ++to) {
+                if (from != to && transitions[from][to] && !driven[from][to]) {
+                    supported = false;
+                    break;
+                }
+            }
+        }
+
+        if (supported) {
+            return mode;
+        }
+    }
+
+    return {};
 }
 
-void Display::align_update()
+void Display::select_mode()
 {
-    constexpr auto mask = buf_actual_depth - 1;
     auto& update = this->generate_update;
 
-    if (
-        (update.region.width & mask) == 0
-        && (update.region.left & mask) == 0
-    ) {
+    if (update.mode == auto_mode) {
+        const auto& waveforms = this->generate_waveforms->waveforms;
+        auto mode = this->find_fastest_mode(this->auto_modes);
+
+        if (!mode) {
+            // Use the slowest mode, which drives the most transitions
+            mode = *std::max_element(
+                this->auto_modes.cbegin(), this->auto_modes.cend(),
+                [&waveforms](ModeID a, ModeID b) {
+                    return waveforms[a]->size() < waveforms[b]->size();
+                }
+            );
+        }
+
+        update.mode = *mode;
+    }
+}
+
+void Display::split_preview(const Region& requested)
+{
+    auto& update = this->generate_update;
+
+    if (!update.refine) {
         return;
     }
 
-    auto aligned_left = update.region.left & ~mask;
-    auto pad_left = update.region.left & mask;
-    auto new_width = (pad_left + update.region.width + mask) & ~mask;
-    auto pad_right = new_width - pad_left - update.region.width;
+    const auto& region = update.region;
+    Update refine{
+        {}
+        , *update.refine
+        , requested
+        , {}
+        , {}
+        , {}
+        , {}
+        , {}
+        , {}
+        , /* refinement = */ true
+        , Priority::LOW
+        , /* degraded = */ false
+        , /* queue_time = */ chrono::steady_clock::now()
+#ifdef ENABLE_PERF_REPORT
+        , /* dequeue_time = */ chrono::steady_clock::now()
+        , /* generate_times = */ {}
+        , /* vsync_times = */ {}
+        , /* power_times = */ {}
+        , /* hinted = */ false
+#endif // ENABLE_PERF_REPORT
+    };
 
-    std::vector<Intensity> new_buffer(update.region.height * new_width);
+    // Refine from the full contents of the requested region, already in
+    // EPD coordinates. The padding added by the alignment is left alone by
+    // the preview, so it is taken from the current intensities again when
+    // the refine pass is rendered
+    const auto offset = requested.left - region.left;
+    Layer layer{requested, {}, {}, update.fill, {}, {}};
+
+    if (!update.fill) {
+        layer.storage.resize(requested.width * requested.height);
+        copy_rect(
+            /* source = */ update.buffer.data(),
+            /* source_region = */ Region{
+                /* top = */ 0,
+                /* left = */ offset,
+                /* width = */ requested.width,
+                /* height = */ requested.height
+            },
+            /* source_width = */ region.width,
+            /* dest = */ layer.storage.data(),
+            /* dest_top = */ 0,
+            /* dest_left = */ 0,
+            /* dest_width = */ requested.width
+        );
+    }
 
-    const Intensity* prev = this->current_intensity.data()
-        + update.region.top * epd_width
-        + aligned_left;
+    layer.source = BufferView{
+        layer.storage.data(), requested.width,
+        PixelFormat::INTENSITY, 0, Orientation::EPD
+    };
+    refine.layers.emplace_back(std::move(layer));
 
-    const Intensity* old_next = update.buffer.data();
-    Intensity* new_next = new_buffer.data();
+    // Show the preview in black and white
+    if (update.fill) {
+        update.fill = *update.fill < intensity_values / 2
+            ? 0 : intensity_values - 2;
+    } else {
+        transform_to_epd(
+            BufferView{
+                update.buffer.data() + offset, region.width,
+                PixelFormat::INTENSITY, 0, Orientation::EPD
+            },
+            requested.width, requested.height,
+            update.buffer.data() + offset, region.width,
+            Point{requested.top, requested.left}
+        );
+    }
 
-    for (std::size_t y = 0; y < update.region.height; ++y) {
-        for (std::size_t x = 0; x < pad_left; ++x) {
-            *new_next++ = *prev++;
+    std::lock_guard<std::mutex> lock(this->updates_lock);
+    auto& pending = this->pending_updates;
+
+    // Updates pushed while the preview was waiting are newer than the
+    // refine pass, which is pointless if one of them replaces its region
+    // and must otherwise be shown before the ones that overlap it
+    if (std::any_of(pending.cbegin(), pending.cend(),
+        [&requested](const Update& other) {
+            const auto& first = other.layers.front();
+            return !other.refinement && !first.copy && !first.stroke
+                && contains_region(other.region, requested);
         }
+    )) {
+        return;
+    }
 
-        for (std::size_t x = 0; x < update.region.width; ++x) {
-            *new_next++ = *old_next++;
+    auto next = std::find_if(pending.begin(), pending.end(),
+        [&requested](const Update& other) {
+            const auto& copy = other.layers.front().copy;
+            return intersect_regions(other.region, requested)
+                || (copy && intersect_regions(*copy, requested));
         }
+    );
+
+    refine.id.push_back(this->next_update_id++);
+    pending.insert(next, std::move(refine));
+}
 
-        prev += update.region.width;
+void Display::degrade_mode()
+{
+    auto& update = this->generate_update;
+
+    if (!update.degraded) {
+        return;
+    }
+
+    const auto& waveforms = this->generate_waveforms->waveforms;
+    auto kind = this->table.get_mode_kind(update.mode);
+    auto length = waveforms[update.mode]->size();
+    std::vector<ModeID> modes;
 
-        for (std::size_t x = 0; x < pad_right; ++x) {
-            *new_next++ = *prev++;
+    if (
+        kind == ModeKind::GC16
+        || kind == ModeKind::GLR16
+        || kind == ModeKind::GL16
+    ) {
+        for (auto mode : this->auto_modes) {
+            if (waveforms[mode]->size() < length) {
+                modes.push_back(mode);
+            }
         }
+    }
 
-        prev += epd_width - new_width;
+    auto mode = modes.empty()
+        ? std::nullopt
+        : this->find_fastest_mode(modes);
+
+    if (!mode) {
+        // Keep the requested mode rather than leaving wrong cells
+        update.degraded = false;
+        return;
     }
 
-    update.buffer = std::move(new_buffer);
-    update.region.left = aligned_left;
-    update.region.width = new_width;
+    update.mode = *mode;
 }
 
 std::vector<bool> Display::check_consecutive()
@@ -677,17 +2346,19 @@ std::vector<bool> Display::check_consecutive()
 
 void Display::generate_frames()
 {
-    std::vector<bool> is_consecutive = this->check_consecutive();
     auto& update = this->generate_update;
+    std::vector<bool> is_consecutive = update.fill
+        ? std::vector<bool>{}
+        : this->check_consecutive();
 
     const auto& region = update.region;
     const Intensity* prev_base = this->current_intensity.data()
         + region.top * epd_width
         + region.left;
     const Intensity* next_base = update.buffer.data();
-    const Waveform& waveform = this->table.lookup(
-        update.mode, this->temperature
-    );
+    const Waveform& waveform
+        = *this->generate_waveforms->waveforms[update.mode];
+    this->generate_waveform = &waveform;
 
 #if ENABLE_PERF_REPORT
     update.generate_times.resize(waveform.size() + 1);
@@ -704,6 +2375,16 @@ void Display::generate_frames()
             + (margin_left + region.left / buf_actual_depth) * buf_depth;
 
         const auto& matrix = waveform[k];
+
+        if (update.fill) {
+            this->generate_fill_frame(data, matrix);
+
+#ifdef ENABLE_PERF_REPORT
+            update.generate_times[k + 1] = chrono::steady_clock::now();
+#endif // ENABLE_PERF_REPORT
+            continue;
+        }
+
         const Intensity* prev = prev_base;
         const Intensity* next = next_base;
 
@@ -755,8 +2436,10 @@ void Display::generate_frames()
         update.generate_times[k + 1] = chrono::steady_clock::now();
 #endif // ENABLE_PERF_REPORT
     }
+}
 
-#ifndef DRY_RUN
+void Display::send_frames()
+{
     {
         std::unique_lock<std::mutex> lock(this->vsync_write_lock);
         this->vsync_can_write_cv.wait(lock, [this] {
@@ -764,59 +2447,326 @@ void Display::generate_frames()
         });
         this->vsync_update = this->generate_update;
         std::swap(this->generate_buffer, this->vsync_buffer);
+        this->vsync_can_write = false;
+    }
+
+    {
+        // Set under the lock so that the vsync thread cannot miss it
+        // between checking its predicate and waiting
+        std::lock_guard<std::mutex> lock(this->vsync_read_lock);
+        this->vsync_can_read = true;
     }
 
-    this->vsync_can_write = false;
-    this->vsync_can_read = true;
     this->vsync_can_read_cv.notify_one();
-#else
-#ifdef ENABLE_PERF_REPORT
-    this->make_perf_record();
-#endif // ENABLE_PERF_REPORT
-#endif // DRY_RUN
+}
+
+void Display::generate_fill_frame(
+    std::uint8_t* data,
+    const PhaseMatrix& matrix
+)
+{
+    const auto& update = this->generate_update;
+    const auto& region = update.region;
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const std::size_t groups = region.width / buf_actual_depth;
+
+    // Phase applied to each cell depending on its previous intensity
+    std::array<std::uint8_t, intensity_values> phases;
+
+    for (Intensity i = 0; i < intensity_values; ++i) {
+        phases[i] = static_cast<std::uint8_t>(matrix[i][*update.fill]);
+    }
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        if (y > 0 && std::equal(prev, prev + region.width, prev - epd_width)) {
+            // Same transitions as the row above, repeat its pattern
+            for (std::size_t x = 0; x < groups; ++x) {
+                data[x * buf_depth] = data[x * buf_depth - buf_stride];
+                data[x * buf_depth + 1] = data[x * buf_depth + 1 - buf_stride];
+            }
+        } else {
+            std::uint8_t byte1 = 0;
+            std::uint8_t byte2 = 0;
+
+            for (std::size_t x = 0; x < groups; ++x) {
+                const Intensity* group = prev + x * buf_actual_depth;
+
+                if (
+                    x == 0
+                    || !std::equal(
+                        group, group + buf_actual_depth,
+                        group - buf_actual_depth
+                    )
+                ) {
+                    byte1 = (
+                        (phases[group[4]] << 6)
+                        | (phases[group[5]] << 4)
+                        | (phases[group[6]] << 2)
+                        | phases[group[7]]
+                    );
+
+                    byte2 = (
+                        (phases[group[0]] << 6)
+                        | (phases[group[1]] << 4)
+                        | (phases[group[2]] << 2)
+                        | phases[group[3]]
+                    );
+                }
+
+                data[x * buf_depth] = byte1;
+                data[x * buf_depth + 1] = byte2;
+            }
+        }
+
+        prev += epd_width;
+        data += buf_stride;
+    }
 }
 
 void Display::commit_update()
 {
     const auto& update = this->generate_update;
     const auto& region = update.region;
+    this->track_wear();
+    this->track_regal();
 
     Intensity* prev = this->current_intensity.data()
         + epd_width * region.top + region.left;
+
+    if (update.fill) {
+        for (std::size_t i = 0; i < region.height; ++i) {
+            std::fill(prev, prev + region.width, *update.fill);
+            prev += epd_width;
+        }
+
+        return;
+    }
     const Intensity* next = update.buffer.data();
 
+    // Only GLR16 updates have Regal targets, other modes keep the odd
+    // intensities they were given
+    bool regal = this->regal_supported
+        && this->table.get_mode_kind(update.mode) == ModeKind::GLR16;
+
     for (std::size_t i = 0; i < region.height; ++i) {
-        std::copy(next, next + region.width, prev);
+        if (regal) {
+            // Cells reached through a Regal transition end up white
+            std::replace_copy(
+                next, next + region.width, prev, regal_white, white
+            );
+        } else {
+            std::copy(next, next + region.width, prev);
+        }
+
         prev += epd_width;
         next += region.width;
     }
 }
 
-void Display::run_vsync_thread()
+void Display::apply_regal()
+{
+    auto& update = this->generate_update;
+    const auto& region = update.region;
+
+    if (
+        !this->regal_supported
+        || this->table.get_mode_kind(update.mode) != ModeKind::GLR16
+    ) {
+        return;
+    }
+
+    if (update.fill) {
+        if (*update.fill != white) {
+            return;
+        }
+
+        // Regal targets vary per cell, so a buffer is needed
+        update.buffer.assign(region.width * region.height, white);
+        update.fill.reset();
+    }
+
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    Intensity* next = update.buffer.data();
+
+    const auto width = static_cast<std::int64_t>(region.width);
+    const auto height = static_cast<std::int64_t>(region.height);
+
+    // Check whether the update changes a cell, looking past the Regal
+    // targets set on previous cells
+    const auto changes = [&](std::int64_t y, std::int64_t x) {
+        if (y < 0 || x < 0 || y >= height || x >= width) {
+            return false;
+        }
+
+        auto value = next[y * width + x];
+        return prev[y * epd_width + x]
+            != (value == regal_white ? white : value);
+    };
+
+    for (std::int64_t y = 0; y < height; ++y) {
+        for (std::int64_t x = 0; x < width; ++x) {
+            auto& value = next[y * width + x];
+            auto before = prev[y * epd_width + x];
+
+            if (value != white || !is_regal_source(before)) {
+                continue;
+            }
+
+            auto index = (region.top + y) * epd_width + region.left + x;
+
+            if (
+                this->regal_pending[index]
+                || before != white
+                || changes(y - 1, x) || changes(y + 1, x)
+                || changes(y, x - 1) || changes(y, x + 1)
+            ) {
+                value = regal_white;
+            }
+        }
+    }
+}
+
+void Display::track_regal()
+{
+    const auto& update = this->generate_update;
+    const auto& region = update.region;
+
+    if (!this->regal_supported) {
+        return;
+    }
+
+    auto kind = this->table.get_mode_kind(update.mode);
+    bool cleans = kind == ModeKind::INIT || kind == ModeKind::GC16;
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        auto pending = this->regal_pending.begin()
+            + (region.top + y) * epd_width + region.left;
+
+        for (std::size_t x = 0; x < region.width; ++x, ++pending) {
+            auto value = update.fill ? *update.fill : *next++;
+
+            if (cleans || value == regal_white || value != white) {
+                // Flashed, cleaned with Regal, or not white
+                *pending = false;
+            } else if (prev[x] != white) {
+                // Newly turned white without Regal
+                *pending = true;
+            }
+        }
+
+        prev += epd_width;
+    }
+}
+
+void Display::track_wear()
 {
-#ifndef DRY_RUN
-    std::size_t next_frame = 0;
-    bool first_frame = true;
+    const auto& update = this->generate_update;
+    const auto& region = update.region;
+    auto kind = this->table.get_mode_kind(update.mode);
 
+    if (region.width == 0 || region.height == 0) {
+        return;
+    }
+
+    if (
+        kind == ModeKind::A2
+        || kind == ModeKind::DU
+        || kind == ModeKind::DU4
+        || kind == ModeKind::A2_TRIMMED
+        || kind == ModeKind::DU_TRIMMED
+    ) {
+        // Fast updates wear all the tiles they touch, and downgraded
+        // updates need to be cleaned up in any case
+        auto left = region.left / cleanup_tile_size;
+        auto right = (region.left + region.width - 1) / cleanup_tile_size;
+        auto top = region.top / cleanup_tile_size;
+        auto bottom = (region.top + region.height - 1) / cleanup_tile_size;
+        constexpr auto max_wear = std::numeric_limits<std::uint32_t>::max();
+
+        for (auto y = top; y <= bottom; ++y) {
+            for (auto x = left; x <= right; ++x) {
+                auto& wear = this->tile_wear[y * cleanup_tiles_x + x];
+
+                if (update.degraded) {
+                    wear = max_wear;
+                } else if (wear < max_wear) {
+                    ++wear;
+                }
+            }
+        }
+    } else if (
+        kind == ModeKind::INIT
+        || kind == ModeKind::GC16
+        || kind == ModeKind::GLR16
+    ) {
+        // Full refreshes only restore the tiles they entirely cover
+        const auto first = [](std::uint32_t start) {
+            return (start + cleanup_tile_size - 1) / cleanup_tile_size;
+        };
+
+        const auto last = [](std::uint32_t end, std::uint32_t size) {
+            return end == size ? (size + cleanup_tile_size - 1)
+                / cleanup_tile_size : end / cleanup_tile_size;
+        };
+
+        auto left = first(region.left);
+        auto right = last(region.left + region.width, epd_width);
+        auto top = first(region.top);
+        auto bottom = last(region.top + region.height, epd_height);
+
+        for (auto y = top; y < bottom; ++y) {
+            for (auto x = left; x < right; ++x) {
+                this->tile_wear[y * cleanup_tiles_x + x] = 0;
+            }
+        }
+    }
+}
+
+void Display::run_vsync_thread()
+{
     while (!this->stopping_vsync) {
+        bool ready = false;
+
         {
             // Wait for the next update to be ready
             std::unique_lock<std::mutex> lock(this->vsync_read_lock);
             const auto pred = [this] {
-                return this->vsync_can_read || this->stopping_vsync;
+                return this->vsync_can_read
+                    || this->power_requested
+                    || this->stopping_vsync;
             };
 
-            if (!this->vsync_can_read_cv.wait_for(lock, power_off_timeout, pred)) {
+            if (!this->vsync_can_read_cv.wait_for(
+                lock, this->get_power_off_timeout(), pred
+            )) {
                 // Turn off power to save battery when no updates are coming
                 this->set_power(false);
                 this->vsync_can_read_cv.wait(lock, pred);
             }
+
+            ready = this->vsync_can_read;
+            this->power_requested = false;
         }
 
         if (this->stopping_vsync) {
             return;
         }
 
+        if (!ready) {
+            // An update was just queued, power up while its frames are
+            // being generated instead of after
+            this->set_power(true);
+            continue;
+        }
+
 #if ENABLE_PERF_REPORT
         Update& update = this->vsync_update;
         update.vsync_times.resize(this->vsync_buffer.size() + 1);
@@ -824,38 +2774,23 @@ void Display::run_vsync_thread()
 #endif // ENABLE_PERF_REPORT
 
         this->set_power(true);
-        this->update_temperature();
-
-        for (std::size_t k = 0; k < this->vsync_buffer.size(); ++k) {
-            next_frame = (next_frame + 1) % 2;
-
-            std::memcpy(
-                this->framebuffer + next_frame * buf_frame,
-                this->vsync_buffer[k].data(),
-                this->vsync_buffer[k].size()
-            );
 
-            this->var_info.yoffset = next_frame * buf_height;
+#ifdef ENABLE_PERF_REPORT
+        update.power_times = std::move(this->power_up_times);
+        this->power_up_times.clear();
+#endif // ENABLE_PERF_REPORT
 
-            if (
-                ioctl(
-                    this->framebuffer_fd,
-                    first_frame
-                        // Schedule first frame
-                        ? FBIOPUT_VSCREENINFO
-                        // Schedule next frame and wait
-                        // for vsync of previous frame
-                        : FBIOPAN_DISPLAY,
-                    &this->var_info
-                ) == -1
-            ) {
-                // Don’t throw here, since we’re inside a background thread
-                std::cerr << "Vsync and flip: " << std::strerror(errno) << '\n';
-                return;
+        for (std::size_t k = 0; k < this->vsync_buffer.size(); ++k) {
+            try {
+                this->sink->send_frame(this->vsync_buffer[k]);
+            } catch (const std::exception& err) {
+                // Don’t throw here, since we’re inside a background thread.
+                // Drop the rest of this update but keep releasing the
+                // buffer, otherwise the generator would wait for it forever
+                std::cerr << "Send frame: " << err.what() << '\n';
+                break;
             }
 
-            first_frame = false;
-
 #ifdef ENABLE_PERF_REPORT
             update.vsync_times[k + 1] = chrono::steady_clock::now();
 #endif // ENABLE_PERF_REPORT
@@ -865,38 +2800,22 @@ void Display::run_vsync_thread()
         this->make_perf_record();
 #endif // ENABLE_PERF_REPORT
 
-        this->vsync_can_write = true;
         this->vsync_can_read = false;
+
+        {
+            std::lock_guard<std::mutex> lock(this->vsync_write_lock);
+            this->vsync_can_write = true;
+        }
+
         this->vsync_can_write_cv.notify_one();
     }
-#endif // DRY_RUN
-}
-
-void Display::reset_frame(std::size_t frame_index)
-{
-#ifndef DRY_RUN
-    std::copy(
-        this->null_frame.cbegin(),
-        this->null_frame.cend(),
-        this->framebuffer + buf_frame * frame_index
-    );
-#endif // DRY_RUN
 }
 
 #ifdef ENABLE_PERF_REPORT
 void Display::make_perf_record()
 {
-#ifdef DRY_RUN
-    const auto& update = this->generate_update;
-    this->perf_report << update.id << ','
-        << static_cast<int>(update.mode) << ','
-        << update.region.width << ','
-        << update.region.height << ','
-        << update.queue_time << ','
-        << update.dequeue_time << ','
-        << update.generate_times << ",\n";
-#else
     const auto& update = this->vsync_update;
+    std::lock_guard<std::mutex> lock(this->perf_report_lock);
     this->perf_report << update.id << ','
         << static_cast<int>(update.mode) << ','
         << update.region.width << ','
@@ -904,15 +2823,17 @@ void Display::make_perf_record()
         << update.queue_time << ','
         << update.dequeue_time << ','
         << update.generate_times << ','
-        << update.vsync_times << '\n';
-#endif // DRY_RUN
+        << update.vsync_times << ','
+        << update.power_times << ','
+        << update.hinted << '\n';
 }
 
 std::string Display::get_perf_report() const
 {
+    std::lock_guard<std::mutex> lock(this->perf_report_lock);
     return (
         "id,mode,width,height,queue_time,dequeue_time,"
-        "generate_times,vsync_times\n"
+        "generate_times,vsync_times,power_times,hinted\n"
         + this->perf_report.str()
     );
 }
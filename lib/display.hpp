@@ -9,20 +9,22 @@
 
 #include "defs.hpp"
 #include "file_descriptor.hpp"
+#include "frame_sink.hpp"
 #include "waveform_table.hpp"
 #include <atomic>
 #include <optional>
 #include <array>
 #include <condition_variable>
 #include <mutex>
-#include <queue>
+#include <deque>
+#include <memory>
+#include <unordered_map>
 #include <chrono>
 #include <thread>
 #include <cstdlib>
 #include <sstream>
 #include <cstdint>
 #include <vector>
-#include <linux/fb.h>
 
 namespace Waved
 {
@@ -51,6 +53,24 @@ public:
         WaveformTable waveform_table
     );
 
+    /**
+     * Open a display that sends its frames to the given sink.
+     *
+     * This makes it possible to run the whole update pipeline without the
+     * display controller, for example to measure it on another machine
+     * using a `MemorySink`.
+     *
+     * @param sink Destination of the generated frames.
+     * @param temperature_sensor_path Path to the temperature sensor file,
+     * which can be any file containing a temperature in Celsius.
+     * @param waveform_table Display-specific waveform data.
+     */
+    Display(
+        std::unique_ptr<FrameSink> sink,
+        const char* temperature_sensor_path,
+        WaveformTable waveform_table
+    );
+
     /** Discover the path to the framebuffer device. */
     static std::optional<std::string> discover_framebuffer();
 
@@ -64,8 +84,9 @@ public:
      *
      * This method will power on the display controller and process updates
      * added to the queue using `push_update()` continuously from a background
-     * thread. If no updates are received for `power_off_timeout` ticks, the
-     * controller is switched off to save power. Calling `stop()` or destroying
+     * thread. If no updates are received for the power-off timeout (see
+     * `set_power_off_timeout()`), the controller is switched off to save
+     * power. Calling `stop()` or destroying
      * this object will stop the background threads and updates remaining
      * in the queue will not be processed.
      */
@@ -74,14 +95,66 @@ public:
     /** Stop processing updates. */
     void stop();
 
+    /**
+     * Set the default orientation for update regions and buffers.
+     *
+     * Updates whose buffer is supplied as a view can override this
+     * orientation individually.
+     */
+    void set_orientation(Orientation orientation);
+
+    /** Get the default orientation for update regions and buffers. */
+    Orientation get_orientation() const;
+
+    /** Set the priority class of the updates pushed from now on. */
+    void set_priority(Priority priority);
+
+    /** Get the priority class of the updates pushed from now on. */
+    Priority get_priority() const;
+
+    /**
+     * Set the latency target for a priority class.
+     *
+     * When an update of that class waits in the queue for longer than its
+     * target, it is displayed using DU4 or DU instead of a slower GC16, GL16
+     * or GLR16 mode, so that the queue catches up. The tiles it covers are then
+     * marked for background clean-up (see `set_cleanup()`). Updates are only
+     * downgraded while clean-up is enabled, and if a faster mode drives all
+     * their intensity transitions.
+     *
+     * @param priority Priority class to configure.
+     * @param target Maximum queueing time, or zero to never downgrade modes
+     * (the default).
+     */
+    void set_latency_target(
+        Priority priority,
+        std::chrono::milliseconds target
+    );
+
     /**
      * Add an update to the queue.
      *
-     * @param mode Update mode to use (ID or kind).
-     * @param region Coordinates of the region affected by the update.
-     * @param buffer New values for the pixels in the updated region.
+     * @param mode Update mode to use (ID or kind). With `ModeKind::AUTO`, the
+     * fastest mode that supports the content of the update is chosen once
+     * the update is processed.
+     * @param region Coordinates of the region affected by the update, in the
+     * buffer orientation.
+     * @param buffer New values for the pixels in the updated region. Unless
+     * the view is marked as shared, the pixels are copied before this method
+     * returns, so the underlying memory can be reused right away. Pixels are
+     * converted from their format and to EPD coordinates from the generator
+     * thread. With modes that only support black and white (A2 and DU),
+     * gray pixels are dithered during that conversion.
      * @return True if the update was pushed, false if it was deemed invalid.
      */
+    bool push_update(ModeKind mode, Region region, BufferView buffer);
+    bool push_update(ModeID mode, Region region, BufferView buffer);
+
+    /**
+     * @overload
+     * @param buffer New values for the pixels in the updated region, packed
+     * row by row.
+     */
     bool push_update(
         ModeKind mode,
         Region region,
@@ -93,6 +166,310 @@ public:
         const std::vector<Intensity>& buffer
     );
 
+    /**
+     * @overload
+     * @param buffer New values for the pixels in the updated region, packed
+     * row by row. The display takes ownership of the buffer, which avoids
+     * copying it on the caller’s thread.
+     */
+    bool push_update(
+        ModeKind mode,
+        Region region,
+        std::vector<Intensity>&& buffer
+    );
+    bool push_update(
+        ModeID mode,
+        Region region,
+        std::vector<Intensity>&& buffer
+    );
+
+    /**
+     * Add an update that sets a region to a single intensity to the queue.
+     *
+     * No pixel buffer is needed. When the fill covers its whole update,
+     * frames are generated from the previous intensities alone, which makes
+     * clearing large areas cheap.
+     *
+     * @param mode Update mode to use (ID or kind).
+     * @param region Coordinates of the region to fill, in the default
+     * orientation.
+     * @param intensity Intensity to set on every pixel of the region.
+     * @return True if the update was pushed, false if it was deemed invalid.
+     */
+    bool push_fill(ModeKind mode, Region region, Intensity intensity);
+    bool push_fill(ModeID mode, Region region, Intensity intensity);
+
+    /**
+     * Add an update that copies a region of the screen to another location
+     * to the queue.
+     *
+     * The copied pixels are taken from the screen contents as they will be
+     * after all previously pushed updates are applied, so that scrolling
+     * only requires pushing the newly exposed area afterwards. Source and
+     * destination may overlap.
+     *
+     * @param mode Update mode to use (ID or kind).
+     * @param source Coordinates of the region to copy, in the default
+     * orientation.
+     * @param dest Coordinates of the top left corner of the region where
+     * to copy the pixels, in the default orientation.
+     * @return True if the update was pushed, false if it was deemed invalid.
+     */
+    bool push_copy(ModeKind mode, Region source, Point dest);
+    bool push_copy(ModeID mode, Region source, Point dest);
+
+    /**
+     * Add an update that draws a pen stroke to the queue.
+     *
+     * The stroke is rasterized from the generator thread directly into the
+     * update buffer. Strokes pushed while a previous stroke with the same
+     * mode is still waiting in the queue are appended to its update, and
+     * polylines that continue the previous one with the same pen are
+     * extended in place, so that sending each new pen segment separately
+     * stays cheap.
+     *
+     * @param mode Update mode to use (ID or kind).
+     * @param points Points of the polyline to draw, in the default
+     * orientation. A single point draws a dot.
+     * @param width Diameter of the pen, in pixels.
+     * @param color Intensity to paint.
+     * @return True if the update was pushed, false if it was deemed invalid.
+     */
+    bool push_stroke(
+        ModeKind mode,
+        const std::vector<Point>& points,
+        std::uint32_t width,
+        Intensity color
+    );
+    bool push_stroke(
+        ModeID mode,
+        const std::vector<Point>& points,
+        std::uint32_t width,
+        Intensity color
+    );
+
+    /** Identifier for an animation session. */
+    using AnimationID = std::uint32_t;
+
+    /**
+     * Start an animation session on a screen region.
+     *
+     * Frames pushed to the session replace each other while they wait in
+     * the queue, so that the newest frame is shown as soon as the previous
+     * one has been displayed, however fast frames are submitted. Each frame
+     * uses the automatic mode, which is the shortest mode that supports all
+     * the intensity transitions it needs.
+     *
+     * @param region Coordinates of the animated region, in the default
+     * orientation.
+     * @return Identifier of the new session, or nothing if the region
+     * is invalid.
+     */
+    std::optional<AnimationID> start_animation(Region region);
+
+    /**
+     * Add a frame to an animation session.
+     *
+     * @param animation Session identifier.
+     * @param buffer New values for the pixels in the animated region, in
+     * the orientation that was the default when the session started. The
+     * orientation of the view, if any, is ignored.
+     * @return True if the frame was pushed, false if it was deemed invalid.
+     */
+    bool push_frame(AnimationID animation, BufferView buffer);
+
+    /**
+     * @overload
+     * @param buffer New values for the pixels in the animated region,
+     * packed row by row.
+     */
+    bool push_frame(
+        AnimationID animation,
+        const std::vector<Intensity>& buffer
+    );
+
+    /**
+     * @overload
+     * @param buffer New values for the pixels in the animated region,
+     * packed row by row. The display takes ownership of the buffer.
+     */
+    bool push_frame(AnimationID animation, std::vector<Intensity>&& buffer);
+
+    /**
+     * Get the number of frames of a session that were replaced by a newer
+     * frame before being displayed.
+     */
+    std::size_t get_dropped_frames(AnimationID animation);
+
+    /**
+     * Stop an animation session.
+     *
+     * The last pushed frame is still displayed if it is pending.
+     *
+     * @return Number of frames that were dropped during the session.
+     */
+    std::size_t stop_animation(AnimationID animation);
+
+    /** Identifier for a prepared update. */
+    using PreparedID = std::uint32_t;
+
+    /**
+     * Prepare an update to be pushed later.
+     *
+     * The frames of the update are generated in advance when no other
+     * updates are waiting, assuming that the screen contents will not change
+     * until the update is committed. This makes committing predictable
+     * updates, such as turning to the next page, start almost immediately.
+     *
+     * @param mode Update mode to use (ID or kind).
+     * @param region Coordinates of the region affected by the update, in the
+     * buffer orientation.
+     * @param buffer New values for the pixels in the updated region. The
+     * pixels are copied unless the view is marked as shared, in which case
+     * they must stay valid until the update is committed or discarded.
+     * @return Identifier of the prepared update, or nothing if it was deemed
+     * invalid.
+     */
+    std::optional<PreparedID> prepare_update(
+        ModeKind mode,
+        Region region,
+        BufferView buffer
+    );
+    std::optional<PreparedID> prepare_update(
+        ModeID mode,
+        Region region,
+        BufferView buffer
+    );
+
+    /**
+     * @overload
+     * @param buffer New values for the pixels in the updated region, packed
+     * row by row. The display takes ownership of the buffer.
+     */
+    std::optional<PreparedID> prepare_update(
+        ModeKind mode,
+        Region region,
+        std::vector<Intensity>&& buffer
+    );
+    std::optional<PreparedID> prepare_update(
+        ModeID mode,
+        Region region,
+        std::vector<Intensity>&& buffer
+    );
+
+    /**
+     * Add a prepared update to the queue.
+     *
+     * If its frames are ready and the screen contents and temperature did
+     * not change since they were generated, they are sent as is. Otherwise,
+     * frames are generated as for any other update.
+     *
+     * @param prepared Prepared update identifier.
+     * @return True if the update was pushed, false if the identifier is
+     * unknown.
+     */
+    bool commit(PreparedID prepared);
+
+    /** Forget about a prepared update that will not be committed. */
+    void discard(PreparedID prepared);
+
+    /**
+     * Add a two-phase update to the queue.
+     *
+     * The new contents are first dithered to black and white and shown using
+     * a fast mode (A2 or DU), then refined using the given mode with a low priority.
+     * The refine pass is cancelled if a newer update replaces the whole
+     * region before it starts.
+     *
+     * @param mode Mode of the refine pass (ID or kind), usually GC16 or
+     * GLR16.
+     * @param region Coordinates of the region affected by the update, in the
+     * buffer orientation.
+     * @param buffer New values for the pixels in the updated region, copied
+     * unless the view is marked as shared.
+     * @return True if the update was pushed, false if it was deemed invalid.
+     */
+    bool push_preview(ModeKind mode, Region region, BufferView buffer);
+    bool push_preview(ModeID mode, Region region, BufferView buffer);
+
+    /**
+     * @overload
+     * @param buffer New values for the pixels in the updated region, packed
+     * row by row. The display takes ownership of the buffer.
+     */
+    bool push_preview(
+        ModeKind mode,
+        Region region,
+        std::vector<Intensity>&& buffer
+    );
+    bool push_preview(
+        ModeID mode,
+        Region region,
+        std::vector<Intensity>&& buffer
+    );
+
+    /**
+     * Configure the background clean-up of ghosting left by fast updates.
+     *
+     * Fast modes (A2, DU, DU4 and their trimmed variants) leave ghosting
+     * behind which builds up with each update. The display counts the fast
+     * updates received by each tile of the screen since its last full
+     * refresh. When no update is received for `cleanup_delay`, tiles that
+     * received at least `threshold` fast updates are refreshed in the
+     * background, before the controller is powered off. Clean-up is enabled
+     * by default with the GC16 mode.
+     *
+     * @param mode Mode used for refreshing tiles, usually GC16 or GLR16.
+     * GLR16 does not flash and uses Regal transitions for white cells that
+     * need it, while GC16 flashes all cells.
+     * @param threshold Number of fast updates after which a tile needs to
+     * be refreshed, or zero to disable clean-up.
+     * @return True if the settings were changed, false if the mode is
+     * not a GC16 or GLR16 mode.
+     */
+    bool set_cleanup(ModeKind mode, std::uint32_t threshold);
+    bool set_cleanup(ModeID mode, std::uint32_t threshold);
+
+    /**
+     * Set the time without updates after which the controller is switched
+     * off to save power.
+     *
+     * By default, the timeout adapts to the time between updates that are
+     * not part of the same burst: it grows when updates keep coming
+     * before the controller is switched off, for example page turns while
+     * reading, so that it does not need to be powered up for each of them,
+     * and shrinks back when updates come after it was already off.
+     *
+     * @param timeout Fixed timeout for the rest of the session, or zero to
+     * use the adaptive timeout.
+     */
+    void set_power_off_timeout(std::chrono::milliseconds timeout);
+
+    /** Get the current power-off timeout. */
+    std::chrono::milliseconds get_power_off_timeout() const;
+
+    /** Get the number of times the controller was powered up. */
+    std::size_t get_power_ups() const;
+
+    /** Get the number of times the controller was powered down. */
+    std::size_t get_power_downs() const;
+
+    /**
+     * Raise a performance hint while frames are being generated.
+     *
+     * When the generator thread starts working on a burst of updates, it
+     * opens the given file and writes `value` to it, then restores the
+     * previous contents and closes the file once no updates are left. This
+     * works with cpufreq attributes, for example by writing "performance"
+     * to `/sys/devices/system/cpu/cpufreq/policy0/scaling_governor`, and
+     * with PM QoS files such as `/dev/cpu_dma_latency`, whose requests
+     * last as long as the file stays open.
+     *
+     * @param path Path to the file to write to, or empty to disable hints.
+     * @param value Contents written to the file while the hint is raised.
+     */
+    void set_performance_hint(std::string path, std::string value);
+
 #ifdef ENABLE_PERF_REPORT
     /**
      * Get the performance report for past updates as a CSV string.
@@ -109,14 +486,22 @@ public:
      * generate_times - List of timestamps when each frame generation
      *     was finished
      * vsync_times - List of timestamps when each frame vsync was finished
+     * power_times - Timestamps when the display started and finished
+     *     powering up before the update, if it was off
+     * hinted - 1 if the performance hint was raised while generating the
+     *     frames of the update, 0 otherwise
      *
      * Fields that contain a variable number of values (ids, generate_times,
-     * and vsync_times) are colon-separated.
+     * vsync_times and power_times) are colon-separated.
      */
     std::string get_perf_report() const;
 #endif
 
 private:
+    // Microbenchmarks of the individual update processing steps
+    // (see src/bench)
+    friend class DisplayBench;
+
     // Display-specific waveform information
     WaveformTable table;
 
@@ -127,83 +512,134 @@ private:
     std::atomic<bool> stopping_generator = false;
     std::atomic<bool> stopping_vsync = false;
 
-    // File descriptor for the framebuffer device
-    FileDescriptor framebuffer_fd;
+    // Destination of the generated frames
+    std::unique_ptr<FrameSink> sink;
+
+    // Initial time after which to switch the controller off if no updates
+    // are received
+    static constexpr std::chrono::milliseconds default_power_off_timeout{3000};
+
+    // Bounds of the adaptive power-off timeout, the lower one leaving
+    // enough time for ghosting clean-up after `cleanup_delay`
+    static constexpr std::chrono::milliseconds min_power_off_timeout{2000};
+    static constexpr std::chrono::milliseconds max_power_off_timeout{60000};
+
+    // Time between updates below which they are part of the same burst and
+    // do not count towards the adaptive power-off timeout
+    static constexpr std::chrono::milliseconds burst_gap{1000};
+
+    // Fixed power-off timeout set for the session, or zero if adaptive
+    std::atomic<std::chrono::milliseconds> fixed_power_off_timeout{
+        std::chrono::milliseconds::zero()
+    };
+
+    // Current adaptive power-off timeout
+    std::atomic<std::chrono::milliseconds> adaptive_power_off_timeout{
+        default_power_off_timeout
+    };
 
-    // Pointer to the mmap’ed framebuffer
-    std::uint8_t* framebuffer = nullptr;
+    // Time when the last update was queued, and moving average of the gaps
+    // between bursts of updates (guarded by updates_lock)
+    std::chrono::steady_clock::time_point last_arrival{};
+    std::chrono::milliseconds average_gap{default_power_off_timeout};
 
-    // Time after which to switch the controller off if no updates are received
-    static constexpr std::chrono::milliseconds power_off_timeout{3000};
+    /** Update the adaptive power-off timeout when an update is queued. */
+    void track_arrival();
 
     // True if the display is powered on
-    bool power_state = false;
+    std::atomic<bool> power_state = false;
+
+    // Number of times the display was powered up and down
+    std::atomic<std::size_t> power_ups = 0;
+    std::atomic<std::size_t> power_downs = 0;
 
     /** Turn the display controller on or off. */
     void set_power(bool power_state);
 
-    // Interval at which to take readings of the panel temperature
-    static constexpr std::chrono::seconds temperature_read_interval{30};
+    // Set when an update is queued while the display is off, so that the
+    // vsync thread powers it on while frames for the update are generated
+    // (guarded by vsync_read_lock)
+    bool power_requested = false;
 
-    // File descriptor for reading the panel temperature
-    FileDescriptor temp_sensor_fd;
+    /** Ask the vsync thread to power on the display if it is off. */
+    void request_power();
 
-    // Last panel temperature reading and timestamp
-    int temperature = 0;
-    std::chrono::steady_clock::time_point temperature_last_read;
+    // File and contents used for raising the performance hint
+    // (guarded by performance_hint_lock)
+    std::string performance_hint_path;
+    std::string performance_hint_value;
+    std::mutex performance_hint_lock;
 
-    /** Update the panel temperature reading, if needed. */
-    void update_temperature();
+    // File through which the performance hint is raised, and its contents
+    // before that (only accessed by the generator thread)
+    std::optional<FileDescriptor> performance_hint_fd;
+    std::string performance_hint_previous;
 
-    // Structures used for communicating with the display controller
-    fb_var_screeninfo var_info{};
-    fb_fix_screeninfo fix_info{};
+    /** Raise the performance hint, if it is set and not already raised. */
+    void raise_performance_hint();
 
-    // Fixed sizes for the framebuffer. Ideally, those sizes would be provided
-    // by var_info and fix_info above so we don’t have to hardcode them, but
-    // unfortunately they don’t match exactly
+    /** Restore the contents of the hint file and close it. */
+    void release_performance_hint();
 
-    // Number of pixels in a row of the buffer
-    static constexpr std::uint32_t buf_width = 260;
+    // Interval at which to take readings of the panel temperature
+    static constexpr std::chrono::seconds temperature_read_interval{30};
 
-    // Number of bytes per pixel. The first two bytes of each pixel contain
-    // data for 8 actual display pixels (2 bits per pixel). The third byte
-    // contains a fixed value whose role is unclear (probably some sync
-    // markers). The fourth byte is null
-    static constexpr std::uint32_t buf_depth = 4;
+    // File descriptor for reading the panel temperature
+    FileDescriptor temp_sensor_fd;
 
-    // Number of bytes per row
-    static constexpr std::uint32_t buf_stride = buf_width * buf_depth;
+    // Minimum change in the readings for the panel temperature to be
+    // updated, which avoids switching back and forth between waveforms
+    // when the temperature hovers around a threshold
+    static constexpr int temperature_hysteresis = 2;
 
-    // Number of actual display pixels in each buffer pixel (see above)
-    static constexpr std::uint32_t buf_actual_depth = 8;
+    // Current panel temperature
+    std::atomic<int> temperature = 0;
 
-    // Number of rows in the screen
-    static constexpr std::uint32_t buf_height = 1408;
+    /**
+     * Take a reading of the panel temperature.
+     *
+     * @throws std::system_error If the sensor cannot be read.
+     * @throws std::invalid_argument If the reading is invalid.
+     */
+    int read_temperature();
 
-    // Total size of a frame in bytes
-    static constexpr std::uint32_t buf_frame = buf_stride * buf_height;
+    // Thread that polls the temperature sensor, so that other threads never
+    // wait on the sensor
+    std::thread temperature_thread;
+    void run_temperature_thread();
 
-    // Buffer type for a single frame
-    using Frame = std::array<std::uint8_t, buf_frame>;
+    // Signals that the temperature thread needs to stop
+    bool stopping_temperature = false;
+    std::condition_variable temperature_cv;
+    std::mutex temperature_lock;
 
-    // Number of frames held in the buffer. The buffer contains more space
-    // than is needed for holding a single frame. This extra space is used to
-    // prepare the upcoming frames while the current frame is being sent to
-    // the display controller
-    static constexpr std::uint32_t buf_total_frames = 17;
+    /** Waveforms of all modes for a given temperature range. */
+    struct ResolvedWaveforms
+    {
+        // Index of the temperature range
+        std::size_t range;
 
-    // The MXSFB driver automatically flips to the last frame of the buffer
-    // after each vsync (unless we ask for another flip within the next
-    // vsync interval). By storing a null frame at this default location, we
-    // ensure that a charge is never applied for too long on the EPD, even
-    // if there is a bug in our program. This feature is called “prevent frying
-    // pan” mode in the MXSFB kernel driver
-    static constexpr std::uint32_t buf_default_frame = 16;
+        // Waveform of each mode in that range
+        std::vector<const Waveform*> waveforms;
 
-    // Number of usable frames, excluding the default frame which
-    // we shouldn’t change for reasons stated above
-    static constexpr std::uint32_t buf_usable_frames = 16;
+        // Transitions driven by each mode in that range
+        std::vector<TransitionSet> transitions;
+    };
+
+    // Waveforms for the range of the current panel temperature, replaced
+    // as a whole by the temperature thread (access with std::atomic_load
+    // and std::atomic_store)
+    std::shared_ptr<const ResolvedWaveforms> resolved_waveforms;
+
+    /**
+     * Look up the waveforms of all modes for the range of a temperature
+     * and compute their derived tables.
+     *
+     * @throws std::out_of_range If the temperature is not supported.
+     */
+    std::shared_ptr<const ResolvedWaveforms> resolve_waveforms(
+        int temperature
+    ) const;
 
     // Margins of unused pixels in each frame of the buffer
     static constexpr std::uint32_t margin_top = 3;
@@ -243,6 +679,65 @@ private:
 
     static UpdateID next_update_id;
 
+    /** Polyline to draw with a round pen. */
+    struct Stroke
+    {
+        // Points of the polyline, in the EPD coordinate system
+        std::vector<Point> points;
+
+        // Diameter of the pen
+        std::uint32_t width;
+
+        // Intensity to paint
+        Intensity color;
+    };
+
+    /** Contents of an update, before conversion to EPD coordinates. */
+    struct Layer
+    {
+        // Coordinates of the layer, in the EPD coordinate system
+        Region region{};
+
+        // Pixels of the layer, in their original orientation (set unless
+        // the layer is a fill, a copy or a stroke)
+        BufferView source{};
+
+        // Buffer that holds the pixels, if they were copied from
+        // or handed over by the caller
+        std::vector<Intensity> storage;
+
+        // Intensity of all pixels in the layer, if it is a fill
+        std::optional<Intensity> fill{};
+
+        // Region of the current intensities to copy to the layer, in the
+        // EPD coordinate system, if it is a copy
+        std::optional<Region> copy{};
+
+        // Polyline to draw over the previous contents, if it is a stroke
+        std::optional<Stroke> stroke{};
+    };
+
+    /** Frames generated in advance for a prepared update. */
+    struct PreparedFrames
+    {
+        // Intensities of the region for which the frames were generated
+        std::vector<Intensity> expected;
+
+        // Cells of the region that were pending Regal cleaning when the
+        // frames were generated, if the update uses Regal transitions
+        std::vector<bool> expected_regal;
+
+        // Waveform from which the frames were generated
+        const Waveform* waveform;
+
+        // Mode requested for the update, before choosing the automatic mode
+        ModeID mode;
+
+        // Phases of the region in each frame, with the two bytes of each
+        // group of cells packed together
+        std::vector<std::vector<std::uint8_t>> frames;
+    };
+
     /** Information about a display update being processed. */
     struct Update
     {
@@ -256,13 +751,45 @@ private:
         // Coordinates of the region affected by the update
         Region region{};
 
-        // Buffer containing the new intensities of the region
+        // Contents to draw on the region, in order. Usually contains just a
+        // single layer, but can contain more if several updates are
+        // merged together
+        std::vector<Layer> layers;
+
+        // Buffer containing the new intensities of the region, rendered
+        // from the layers once the update is dequeued
         std::vector<Intensity> buffer;
 
-#ifdef ENABLE_PERF_REPORT
+        // Intensity of all pixels in the region, if the update is a single
+        // fill covering the region. In that case, the buffer is left empty
+        std::optional<Intensity> fill{};
+
+        // Animation session to which the update belongs, if any
+        std::optional<AnimationID> animation{};
+
+        // Frames generated in advance, if the update was prepared. In that
+        // case, the region is already aligned and the buffer rendered
+        std::shared_ptr<const PreparedFrames> prepared{};
+
+        // Mode of the refine pass to queue once the update is shown as a
+        // preview, if the update is the first phase of a preview
+        std::optional<ModeID> refine{};
+
+        // True if the update is the refine pass of a preview, which is
+        // cancelled if a newer update replaces its region
+        bool refinement = false;
+
+        // Priority class of the update
+        Priority priority = Priority::NORMAL;
+
+        // True if the update waited for longer than the latency target of
+        // its class, in which case a faster mode than requested is used
+        bool degraded = false;
+
         // Time of creation and addition to the update queue
         std::chrono::steady_clock::time_point queue_time;
 
+#ifdef ENABLE_PERF_REPORT
         // Time of removal from the update queue
         std::chrono::steady_clock::time_point dequeue_time;
 
@@ -271,14 +798,163 @@ private:
 
         // Vsync start time and individual frame end times
         std::vector<std::chrono::steady_clock::time_point> vsync_times;
+
+        // Start and end times of the display power-up preceding the update
+        std::vector<std::chrono::steady_clock::time_point> power_times;
+
+        // True if the performance hint was raised during frame generation
+        bool hinted = false;
 #endif // ENABLE_PERF_REPORT
     };
 
     // Queue of pending updates
-    std::queue<Update> pending_updates;
+    std::deque<Update> pending_updates;
     std::condition_variable updates_cv;
     std::mutex updates_lock;
 
+    // Placeholder mode for updates whose mode is chosen from their
+    // transitions once they are rendered (see ModeKind::AUTO)
+    static constexpr ModeID auto_mode = 0xFF;
+
+    // Modes among which the automatic mode is chosen
+    std::vector<ModeID> auto_modes;
+
+    /** Get the mode ID for a mode kind, including the automatic mode. */
+    ModeID find_mode(ModeKind mode) const;
+
+    /** Check whether a mode ID can be used for pushing updates. */
+    bool is_valid_mode(ModeID mode) const;
+
+    /**
+     * Check whether a mode only drives cells to black or white, in which
+     * case buffers are dithered when they are rendered.
+     */
+    bool is_binary_mode(ModeID mode) const;
+
+    /**
+     * Find the fastest mode that supports the transitions of the
+     * current update.
+     *
+     * @param modes Candidate modes.
+     * @return Fastest supporting mode at the current temperature, or
+     * nothing if no candidate supports all transitions.
+     */
+    std::optional<ModeID> find_fastest_mode(
+        const std::vector<ModeID>& modes
+    ) const;
+
+    // Priority class of pushed updates
+    std::atomic<Priority> priority = Priority::NORMAL;
+
+    // Latency target for each priority class, or zero for none
+    // (guarded by updates_lock)
+    std::array<std::chrono::milliseconds, priority_count> latency_targets{};
+
+    /**
+     * Switch the current update to a faster mode if it is late, provided
+     * that one drives all the transitions of the update.
+     */
+    void degrade_mode();
+
+    /**
+     * Queue the refine pass of the current update if it is a preview, and
+     * reduce its contents to black and white.
+     *
+     * @param requested Region of the update before it was aligned, which is
+     * the only part changed by the preview and redrawn by the refine pass.
+     */
+    void split_preview(const Region& requested);
+
+    // Side of the square tiles on which ghosting is tracked
+    static constexpr std::uint32_t cleanup_tile_size = 64;
+
+    // Number of tiles on each axis, in EPD coordinates
+    static constexpr std::uint32_t cleanup_tiles_x
+        = (epd_width + cleanup_tile_size - 1) / cleanup_tile_size;
+    static constexpr std::uint32_t cleanup_tiles_y
+        = (epd_height + cleanup_tile_size - 1) / cleanup_tile_size;
+
+    // Time without updates after which ghosted tiles are cleaned up, short
+    // enough for the clean-up to happen before the controller is powered off
+    static constexpr std::chrono::milliseconds cleanup_delay{1500};
+
+    // Number of fast updates each tile received since its last full refresh
+    std::array<std::uint32_t, cleanup_tiles_x * cleanup_tiles_y> tile_wear{};
+
+    // Default number of fast updates after which a tile is cleaned up
+    static constexpr std::uint32_t default_cleanup_threshold = 4;
+
+    // Mode and threshold for cleaning up tiles (guarded by updates_lock)
+    ModeID cleanup_mode = 0;
+    std::uint32_t cleanup_threshold = 0;
+
+    // True while the generator thread is working through ghosted tiles
+    bool cleaning = false;
+
+    /** Update the wear of tiles after an update is committed. */
+    void track_wear();
+
+    /**
+     * Find a rectangle of tiles that need to be cleaned up.
+     *
+     * @return Region covering the tiles, or nothing if no tile needs it.
+     */
+    std::optional<Region> find_worn_tiles() const;
+
+    /**
+     * Take the next clean-up update as the current update.
+     *
+     * @return True if an update was taken, false if no tile needs it.
+     */
+    bool pop_cleanup();
+
+    /** State of an animation session. */
+    struct Animation
+    {
+        // Animated region, in the session orientation
+        Region region;
+
+        // Orientation of the region and frames
+        Orientation orientation;
+
+        // Number of frames replaced before being displayed
+        std::size_t dropped = 0;
+    };
+
+    // Ongoing animation sessions (guarded by updates_lock)
+    std::unordered_map<AnimationID, Animation> animations;
+    AnimationID next_animation_id = 0;
+
+    /** State of a prepared update. */
+    struct Prepared
+    {
+        // Update to push when committed
+        Update update;
+
+        // True while the generator thread is working on the update
+        bool generating = false;
+
+        // Set if the update was committed or discarded while generating
+        bool committed = false;
+        bool discarded = false;
+    };
+
+    // Prepared updates and queue of those whose frames are not yet
+    // generated (guarded by updates_lock)
+    std::unordered_map<PreparedID, Prepared> prepared_updates;
+    std::deque<PreparedID> unprepared_updates;
+    PreparedID next_prepared_id = 0;
+
+    // Waveforms resolved when the current update was popped, so that all
+    // its processing steps see the same temperature range
+    std::shared_ptr<const ResolvedWaveforms> generate_waveforms;
+
+    // Waveform used for the last frames generated by generate_frames()
+    const Waveform* generate_waveform = nullptr;
+
+    /** Get a copy of the state of an animation session, if it exists. */
+    std::optional<Animation> find_animation(AnimationID animation);
+
     // Frame that leaves cell intensities unchanged
     Frame null_frame{};
 
@@ -306,53 +982,223 @@ private:
     std::mutex vsync_write_lock;
 
 #ifdef ENABLE_PERF_REPORT
+    // Rows of the performance report (guarded by perf_report_lock)
     std::ostringstream perf_report;
+    mutable std::mutex perf_report_lock;
+
+    // Start and end times of the last power-up, until they are reported
+    // with the next vsynced update
+    std::vector<std::chrono::steady_clock::time_point> power_up_times;
 #endif
 
+    // Default orientation of update regions and buffers
+    std::atomic<Orientation> orientation = Orientation::ROTATE_0;
+
+    /**
+     * Convert a region from the given orientation to EPD coordinates.
+     *
+     * @return Converted region, or nothing if it is out of the screen bounds.
+     */
+    static std::optional<Region> transform_region(
+        Region region,
+        Orientation orientation
+    );
+
+    /**
+     * Create a layer from a caller buffer.
+     *
+     * @param region Coordinates of the layer, in the buffer orientation.
+     * @param buffer View on the pixels, with its orientation set.
+     * @return Created layer, or nothing if the region is invalid.
+     */
+    static std::optional<Layer> make_layer(Region region, BufferView buffer);
+
+    /**
+     * @overload
+     * @param buffer Pixels packed row by row, which the layer takes over.
+     * @param orientation Orientation of the region and buffer.
+     */
+    static std::optional<Layer> make_layer(
+        Region region,
+        std::vector<Intensity>&& buffer,
+        Orientation orientation
+    );
+
+    /**
+     * Create an update from a validated layer and add it to the queue.
+     *
+     * @param mode Update mode.
+     * @param layer Contents of the update.
+     * @param animation Animation session to which the update belongs. If
+     * a frame of the same session is still pending, its contents are
+     * replaced instead of queueing a new update.
+     * @param refine Mode of the refine pass, if the update is a preview.
+     * @return True if the update was queued, false if its animation session
+     * was stopped.
+     */
+    bool enqueue_update(
+        ModeID mode,
+        Layer&& layer,
+        std::optional<AnimationID> animation = {},
+        std::optional<ModeID> refine = {}
+    );
+
+    /**
+     * Add a validated stroke layer to the last queued update, if it has
+     * the same mode and priority class and could be merged with a new
+     * update (see `merge_update()`).
+     *
+     * @return True if the stroke was added, false if a new update needs
+     * to be created.
+     */
+    bool append_stroke(ModeID mode, Layer& layer);
+
     /** Thread that processes update requests and generates frames. */
     std::thread generator_thread;
     void run_generator_thread();
 
-    /** Wait for the next update to be added to the queue and process it. */
+    /**
+     * Wait for the next update to be added to the queue and process it.
+     *
+     * When the queue is empty, frames for prepared updates are generated
+     * instead.
+     */
     void process_update();
 
+    /** Add a prepared update to the list of updates to generate. */
+    std::optional<PreparedID> enqueue_prepared(ModeID mode, Layer&& layer);
+
+    /**
+     * Take the next prepared update whose frames need to be generated.
+     *
+     * The update is placed in `generate_update`.
+     *
+     * @return Identifier of the update, or nothing if there is none.
+     */
+    std::optional<PreparedID> pop_prepared();
+
+    /**
+     * Store the frames generated for the current update, once prepared.
+     *
+     * @param prepared Identifier of the update.
+     * @param requested_mode Mode of the update before it was rendered.
+     */
+    void store_prepared(PreparedID prepared, ModeID requested_mode);
+
+    /**
+     * Add a committed prepared update to the queue. Must be called with
+     * updates_lock held, after which the caller must notify updates_cv
+     * and call `request_power()`.
+     */
+    void queue_prepared(Update&& update);
+
+    /**
+     * Restore the frames of the current update, if it was prepared and
+     * its frames are still valid.
+     *
+     * @return True if the frames were restored, false if they need to
+     * be generated.
+     */
+    bool restore_prepared();
+
+    /** Align, render and choose the mode of the current update. */
+    void build_update();
+
     /**
      * Remove the next update from the queue (or wait if queue is empty).
      *
      * The new update is placed in `generate_update`.
      *
      * @return True if a new update is available, false if the generator
-     * thread should stop.
+     * thread should stop or prepared updates are waiting for generation.
      */
     bool pop_update();
 
     /**
      * Try to merge the next update from the queue into the current update.
      *
-     * Two updates can be merged if they bear the same update mode.
-     * This assumes that a lock on updates_lock is already held by
-     * the current thread.
+     * Two updates can be merged if they bear the same update mode, unless
+     * the next update starts with a copy, which needs to read intensities
+     * left by the updates in the current batch, or either is an animation
+     * frame or a prepared update. Only
+     * the update regions are combined and the layers of the merged update
+     * are appended to those of the current update, actual pixels are only
+     * processed when rendering. This assumes that a lock on updates_lock is
+     * already held by the current thread.
      *
      * @return True if an update was merged into the current update,
      * false otherwise.
      */
     bool merge_update();
 
-    /** Align the current update on a 8-pixel boundary on the X axis. */
+    /** Align the current update region on a 8-pixel boundary on the X axis. */
     void align_update();
 
+    /**
+     * Render the layers of the current update into its buffer.
+     *
+     * Each layer is converted to EPD coordinates directly into its final
+     * place in the buffer, and the parts of the region that are not covered
+     * by any layer keep their current intensity.
+     */
+    void render_update();
+
+    /** Find the set of intensity transitions in the current update. */
+    TransitionSet find_transitions() const;
+
+    /**
+     * Choose the mode of the current update, if it uses the automatic mode.
+     *
+     * The shortest mode in `auto_modes` at the current temperature that
+     * drives all the transitions of the update is chosen, or the longest one
+     * if none does.
+     */
+    void select_mode();
+
     /** Scan update to find pixel transitions equal to their predecessor. */
     std::vector<bool> check_consecutive();
 
     /** Prepare phase frames for the current update. */
     void generate_frames();
 
-    /** Store a null frame at the given buffer location. */
-    void reset_frame(std::size_t frame_index);
+    /** Hand the frames of the current update over to the vsync thread. */
+    void send_frames();
+
+    /**
+     * Write the phases of a frame for the current update, which must be
+     * a fill covering its region.
+     *
+     * Since all cells move to the same intensity, phases only depend on
+     * the previous intensities, and rows whose previous intensities match
+     * the row above reuse its pattern.
+     *
+     * @param data Pointer to the top-left cell of the region in the frame.
+     * @param matrix Phase matrix of the frame.
+     */
+    void generate_fill_frame(std::uint8_t* data, const PhaseMatrix& matrix);
 
     /** Update current_intensity status with the current update. */
     void commit_update();
 
+    // True if the waveform table has a mode supporting Regal transitions
+    bool regal_supported = false;
+
+    // Cells that were turned white without a Regal transition since they
+    // were last cleaned, and which may show ghosting of their former state
+    std::vector<bool> regal_pending;
+
+    /**
+     * Replace the white targets of a GLR16 update with the Regal target
+     * for the cells that need it.
+     *
+     * Those are the white or near-white cells that are pending cleaning,
+     * or that are next to a cell changed by the update.
+     */
+    void apply_regal();
+
+    /** Update the cells pending Regal treatment with the current update. */
+    void track_regal();
+
     /** Thread that sends ready frames to the display controller via vsync. */
     std::thread vsync_thread;
     void run_vsync_thread();
@@ -0,0 +1,347 @@
+/**
+ * @file
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "frame_sink.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+namespace Waved
+{
+
+MxsfbSink::MxsfbSink(const char* framebuffer_path)
+: framebuffer_fd(framebuffer_path, O_RDWR)
+{}
+
+void MxsfbSink::start(const Frame& null_frame)
+{
+    if (
+        ioctl(
+            this->framebuffer_fd,
+            FBIOGET_VSCREENINFO,
+            &this->var_info
+        ) == -1
+    ) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Fetch display vscreeninfo"
+        );
+    }
+
+    if (
+        ioctl(
+            this->framebuffer_fd,
+            FBIOGET_FSCREENINFO,
+            &this->fix_info
+        ) == -1
+    ) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Fetch display fscreeninfo"
+        );
+    }
+
+    if (
+        this->var_info.xres != buf_width
+        || this->var_info.yres != buf_height
+        || this->var_info.xres_virtual != buf_width
+        || this->var_info.yres_virtual !=
+            buf_height * buf_total_frames
+        || this->fix_info.smem_len < buf_width * buf_height
+            * buf_total_frames * buf_depth
+    ) {
+        throw std::runtime_error("The framebuffer has invalid dimensions");
+    }
+
+    // Map the framebuffer to memory
+    void* mmap_res = mmap(
+        /* addr = */ nullptr,
+        /* len = */ this->fix_info.smem_len,
+        /* prot = */ PROT_READ | PROT_WRITE,
+        /* flags = */ MAP_SHARED,
+        /* fd = */ this->framebuffer_fd,
+        /* __offset = */ 0
+    );
+
+    if (mmap_res == MAP_FAILED)
+    {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Map framebuffer to memory"
+        );
+    }
+
+    this->framebuffer = reinterpret_cast<std::uint8_t*>(mmap_res);
+    this->next_frame = 0;
+    this->first_frame = true;
+
+    // Reset all frames
+    for (std::size_t i = 0; i < buf_total_frames; ++i) {
+        std::copy(
+            null_frame.cbegin(),
+            null_frame.cend(),
+            this->framebuffer + buf_frame * i
+        );
+    }
+}
+
+void MxsfbSink::stop()
+{
+    if (this->framebuffer != nullptr) {
+        munmap(this->framebuffer, this->fix_info.smem_len);
+        this->framebuffer = nullptr;
+    }
+}
+
+bool MxsfbSink::set_power(bool power_state)
+{
+    constexpr int fbioblank_off = FB_BLANK_POWERDOWN;
+    constexpr int fbioblank_on = FB_BLANK_UNBLANK;
+
+    return ioctl(
+        this->framebuffer_fd, FBIOBLANK,
+        power_state ? fbioblank_on : fbioblank_off
+    ) == 0;
+}
+
+void MxsfbSink::send_frame(const Frame& frame)
+{
+    this->next_frame = (this->next_frame + 1) % 2;
+
+    std::memcpy(
+        this->framebuffer + this->next_frame * buf_frame,
+        frame.data(),
+        frame.size()
+    );
+
+    this->var_info.yoffset = this->next_frame * buf_height;
+
+    if (
+        ioctl(
+            this->framebuffer_fd,
+            this->first_frame
+                // Schedule first frame
+                ? FBIOPUT_VSCREENINFO
+                // Schedule next frame and wait
+                // for vsync of previous frame
+                : FBIOPAN_DISPLAY,
+            &this->var_info
+        ) == -1
+    ) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Vsync and flip"
+        );
+    }
+
+    this->first_frame = false;
+}
+
+EmulatedMxsfbSink::EmulatedMxsfbSink(
+    std::uint8_t frame_rate,
+    std::chrono::milliseconds power_up_delay
+)
+: power_up_delay(power_up_delay)
+{
+    if (frame_rate == 0) {
+        throw std::invalid_argument("Frame rate must be positive");
+    }
+
+    this->vsync_period = std::chrono::duration_cast<
+        std::chrono::steady_clock::duration
+    >(std::chrono::duration<double>(1.0 / frame_rate));
+}
+
+void EmulatedMxsfbSink::start(const Frame& null_frame)
+{
+    this->slots.assign(buf_total_frames, null_frame);
+    this->scanout_slot = buf_default_frame;
+    this->scanout_vsync = -1;
+    this->next_frame = 0;
+}
+
+void EmulatedMxsfbSink::stop()
+{
+    this->slots.clear();
+    this->slots.shrink_to_fit();
+}
+
+bool EmulatedMxsfbSink::set_power(bool power_state)
+{
+    if (power_state && !this->power_state) {
+        std::this_thread::sleep_for(this->power_up_delay);
+        this->vsync_origin = std::chrono::steady_clock::now();
+        this->scanout_vsync = -1;
+    }
+
+    this->power_state = power_state;
+    return true;
+}
+
+void EmulatedMxsfbSink::send_frame(const Frame& frame)
+{
+    // Same slot order as MxsfbSink::send_frame()
+    this->next_frame = (this->next_frame + 1) % 2;
+
+    {
+        std::lock_guard<std::mutex> lock(this->hazards_lock);
+
+        if (!this->power_state) {
+            ++this->hazards.unpowered_frames;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (this->get_scanout_slot(now) == this->next_frame) {
+            ++this->hazards.scanout_writes;
+        }
+
+        if (this->next_frame == buf_default_frame) {
+            ++this->hazards.default_writes;
+        }
+    }
+
+    this->slots[this->next_frame] = frame;
+
+    // Both FBIOPUT_VSCREENINFO and FBIOPAN_DISPLAY take effect on the next
+    // vsync and wait for it
+    auto vsync = this->get_vsync(std::chrono::steady_clock::now()) + 1;
+    std::this_thread::sleep_until(
+        this->vsync_origin + vsync * this->vsync_period
+    );
+
+    std::lock_guard<std::mutex> lock(this->hazards_lock);
+    this->scanout_slot = this->next_frame;
+    this->scanout_vsync = vsync;
+}
+
+auto EmulatedMxsfbSink::get_hazards() const -> Hazards
+{
+    std::lock_guard<std::mutex> lock(this->hazards_lock);
+    return this->hazards;
+}
+
+auto EmulatedMxsfbSink::get_vsync(
+    std::chrono::steady_clock::time_point time
+) const -> std::int64_t
+{
+    if (time < this->vsync_origin) {
+        return -1;
+    }
+
+    return (time - this->vsync_origin) / this->vsync_period;
+}
+
+auto EmulatedMxsfbSink::get_scanout_slot(
+    std::chrono::steady_clock::time_point time
+) const -> std::size_t
+{
+    if (this->get_vsync(time) == this->scanout_vsync) {
+        return this->scanout_slot;
+    }
+
+    // Without a new flip, the controller falls back to the default slot
+    return buf_default_frame;
+}
+
+MemorySink::MemorySink(bool record)
+: record(record)
+{}
+
+void MemorySink::start(const Frame&)
+{}
+
+void MemorySink::stop()
+{}
+
+bool MemorySink::set_power(bool)
+{
+    return true;
+}
+
+void MemorySink::send_frame(const Frame& frame)
+{
+    if (this->record) {
+        std::lock_guard<std::mutex> lock(this->frames_lock);
+        this->frames.push_back(frame);
+    }
+
+    ++this->frame_count;
+}
+
+auto MemorySink::get_frame_count() const -> std::size_t
+{
+    return this->frame_count;
+}
+
+auto MemorySink::take_frames() -> std::vector<Frame>
+{
+    std::lock_guard<std::mutex> lock(this->frames_lock);
+    return std::exchange(this->frames, {});
+}
+
+FileSink::FileSink(const char* path)
+: fd(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644))
+{
+    if (this->fd == -1) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Open frame output " + std::string(path)
+        );
+    }
+}
+
+void FileSink::start(const Frame&)
+{}
+
+void FileSink::stop()
+{}
+
+bool FileSink::set_power(bool)
+{
+    return true;
+}
+
+void FileSink::send_frame(const Frame& frame)
+{
+    const std::uint8_t* data = frame.data();
+    std::size_t remaining = frame.size();
+
+    while (remaining > 0) {
+        auto written = write(this->fd, data, remaining);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            throw std::system_error(
+                errno,
+                std::generic_category(),
+                "Write frame"
+            );
+        }
+
+        data += written;
+        remaining -= written;
+    }
+}
+
+} // namespace Waved
@@ -0,0 +1,287 @@
+/**
+ * @file
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_FRAME_SINK_HPP
+#define WAVED_FRAME_SINK_HPP
+
+#include "file_descriptor.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <linux/fb.h>
+
+namespace Waved
+{
+
+// Fixed sizes for the framebuffer. Ideally, those sizes would be provided
+// by the framebuffer device so we don’t have to hardcode them, but
+// unfortunately they don’t match exactly
+
+// Number of pixels in a row of the buffer
+constexpr std::uint32_t buf_width = 260;
+
+// Number of bytes per pixel. The first two bytes of each pixel contain
+// data for 8 actual display pixels (2 bits per pixel). The third byte
+// contains a fixed value whose role is unclear (probably some sync
+// markers). The fourth byte is null
+constexpr std::uint32_t buf_depth = 4;
+
+// Number of bytes per row
+constexpr std::uint32_t buf_stride = buf_width * buf_depth;
+
+// Number of actual display pixels in each buffer pixel (see above)
+constexpr std::uint32_t buf_actual_depth = 8;
+
+// Number of rows in the screen
+constexpr std::uint32_t buf_height = 1408;
+
+// Total size of a frame in bytes
+constexpr std::uint32_t buf_frame = buf_stride * buf_height;
+
+// Buffer type for a single frame
+using Frame = std::array<std::uint8_t, buf_frame>;
+
+// Number of frames held in the buffer. The buffer contains more space
+// than is needed for holding a single frame. This extra space is used to
+// prepare the upcoming frames while the current frame is being sent to
+// the display controller
+constexpr std::uint32_t buf_total_frames = 17;
+
+// The MXSFB driver automatically flips to the last frame of the buffer
+// after each vsync (unless we ask for another flip within the next
+// vsync interval). By storing a null frame at this default location, we
+// ensure that a charge is never applied for too long on the EPD, even
+// if there is a bug in our program. This feature is called “prevent frying
+// pan” mode in the MXSFB kernel driver
+constexpr std::uint32_t buf_default_frame = 16;
+
+// Number of usable frames, excluding the default frame which
+// we shouldn’t change for reasons stated above
+constexpr std::uint32_t buf_usable_frames = 16;
+
+/**
+ * Destination of the frames generated by a display.
+ *
+ * All methods except the constructor and destructor are called from the
+ * display threads, one at a time.
+ */
+class FrameSink
+{
+public:
+    virtual ~FrameSink() = default;
+
+    /**
+     * Prepare for receiving frames.
+     *
+     * @param null_frame Frame that leaves cell intensities unchanged.
+     * @throws std::system_error If the sink cannot be set up.
+     */
+    virtual void start(const Frame& null_frame) = 0;
+
+    /** Release the resources acquired by `start()`. */
+    virtual void stop() = 0;
+
+    /**
+     * Turn the display controller on or off.
+     *
+     * @return True if the controller is now in the requested state.
+     */
+    virtual bool set_power(bool power_state) = 0;
+
+    /**
+     * Send a frame, waiting for the previous one to be displayed.
+     *
+     * @throws std::system_error If the frame cannot be sent.
+     */
+    virtual void send_frame(const Frame& frame) = 0;
+}; // class FrameSink
+
+/** Sink that drives the EPD through the MXSFB framebuffer device. */
+class MxsfbSink : public FrameSink
+{
+public:
+    /**
+     * Open the framebuffer device.
+     *
+     * @param framebuffer_path Path to the framebuffer device.
+     * @throws std::system_error If the device cannot be opened.
+     */
+    explicit MxsfbSink(const char* framebuffer_path);
+
+    void start(const Frame& null_frame) override;
+    void stop() override;
+    bool set_power(bool power_state) override;
+    void send_frame(const Frame& frame) override;
+
+private:
+    // File descriptor for the framebuffer device
+    FileDescriptor framebuffer_fd;
+
+    // Pointer to the mmap’ed framebuffer
+    std::uint8_t* framebuffer = nullptr;
+
+    // Structures used for communicating with the display controller
+    fb_var_screeninfo var_info{};
+    fb_fix_screeninfo fix_info{};
+
+    // Index of the buffer frame that was last written to
+    std::size_t next_frame = 0;
+
+    // True until the first frame is scheduled
+    bool first_frame = true;
+}; // class MxsfbSink
+
+/**
+ * Sink that emulates the MXSFB framebuffer, for measuring the latency of
+ * updates without a display and checking that frames are never
+ * overwritten while the controller reads them.
+ *
+ * Frames are written to the 17 buffer slots in the same order as
+ * `MxsfbSink`. Each flip waits for the next vsync, which happens at the
+ * frame rate of the waveform table, after which the flipped slot is
+ * scanned out for one frame before the controller falls back to the null
+ * frame of the default slot. Powering up takes a fixed delay and restarts
+ * the vsync clock.
+ */
+class EmulatedMxsfbSink : public FrameSink
+{
+public:
+    /** Unsafe operations detected by the emulation. */
+    struct Hazards
+    {
+        // Frames written to the slot being scanned out
+        std::size_t scanout_writes = 0;
+
+        // Frames written to the default slot, which must hold a null frame
+        std::size_t default_writes = 0;
+
+        // Frames sent while the controller is off
+        std::size_t unpowered_frames = 0;
+    };
+
+    // Default time taken by the controller to power up
+    static constexpr std::chrono::milliseconds default_power_up_delay{50};
+
+    /**
+     * @param frame_rate Number of vsyncs per second, usually the frame rate
+     * of the waveform table.
+     * @param power_up_delay Time taken by the controller to power up.
+     * @throws std::invalid_argument If the frame rate is zero.
+     */
+    explicit EmulatedMxsfbSink(
+        std::uint8_t frame_rate,
+        std::chrono::milliseconds power_up_delay = default_power_up_delay
+    );
+
+    void start(const Frame& null_frame) override;
+    void stop() override;
+    bool set_power(bool power_state) override;
+    void send_frame(const Frame& frame) override;
+
+    /** Get the hazards detected since the sink was created. */
+    Hazards get_hazards() const;
+
+private:
+    // Time between two vsyncs
+    std::chrono::steady_clock::duration vsync_period;
+
+    // Time taken by the controller to power up
+    std::chrono::milliseconds power_up_delay;
+
+    // Emulated framebuffer memory
+    std::vector<Frame> slots;
+
+    // True if the controller is powered on
+    bool power_state = false;
+
+    // Time of the first vsync after the controller powered up
+    std::chrono::steady_clock::time_point vsync_origin;
+
+    // Slot flipped to during the last vsync, and index of that vsync
+    // (the default slot is scanned out after it)
+    std::size_t scanout_slot = buf_default_frame;
+    std::int64_t scanout_vsync = -1;
+
+    // Index of the buffer slot that was last written to
+    std::size_t next_frame = 0;
+
+    /** Get the index of the last vsync before a given time. */
+    std::int64_t get_vsync(std::chrono::steady_clock::time_point time) const;
+
+    /** Get the slot being scanned out at a given time. */
+    std::size_t get_scanout_slot(
+        std::chrono::steady_clock::time_point time
+    ) const;
+
+    // Detected hazards (guarded by hazards_lock)
+    Hazards hazards;
+    mutable std::mutex hazards_lock;
+}; // class EmulatedMxsfbSink
+
+/**
+ * Sink that keeps frames in memory or discards them, for running the
+ * update pipeline without a display.
+ */
+class MemorySink : public FrameSink
+{
+public:
+    /**
+     * @param record True to keep a copy of the received frames, which takes
+     * about 1.5 MB per frame, false to discard them.
+     */
+    explicit MemorySink(bool record = false);
+
+    void start(const Frame& null_frame) override;
+    void stop() override;
+    bool set_power(bool power_state) override;
+    void send_frame(const Frame& frame) override;
+
+    /** Get the number of frames received since the sink was created. */
+    std::size_t get_frame_count() const;
+
+    /** Take the frames recorded since the last call. */
+    std::vector<Frame> take_frames();
+
+private:
+    // True if the received frames are kept
+    bool record;
+
+    // Number of frames received since the sink was created
+    std::atomic<std::size_t> frame_count = 0;
+
+    // Recorded frames (guarded by frames_lock)
+    std::vector<Frame> frames;
+    std::mutex frames_lock;
+}; // class MemorySink
+
+/** Sink that appends the raw bytes of each frame to a file. */
+class FileSink : public FrameSink
+{
+public:
+    /**
+     * Create or truncate the output file.
+     *
+     * @param path Path to the output file.
+     * @throws std::system_error If the file cannot be opened.
+     */
+    explicit FileSink(const char* path);
+
+    void start(const Frame& null_frame) override;
+    void stop() override;
+    bool set_power(bool power_state) override;
+    void send_frame(const Frame& frame) override;
+
+private:
+    // File descriptor for the output file
+    FileDescriptor fd;
+}; // class FileSink
+
+} // namespace Waved
+
+#endif // WAVED_FRAME_SINK_HPP
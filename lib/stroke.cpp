@@ -0,0 +1,218 @@
+/**
+ * @file
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "stroke.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+
+using Waved::Intensity;
+using Waved::Point;
+using Waved::Region;
+
+/** Range of X coordinates, possibly empty or unbounded. */
+struct Span
+{
+    float low = std::numeric_limits<float>::infinity();
+    float high = -std::numeric_limits<float>::infinity();
+
+    bool empty() const
+    {
+        return low > high;
+    }
+
+    /** Extend the span to include another span. */
+    void join(Span other)
+    {
+        if (!other.empty()) {
+            this->low = std::min(this->low, other.low);
+            this->high = std::max(this->high, other.high);
+        }
+    }
+
+    /** Restrict the span to another span. */
+    void meet(Span other)
+    {
+        this->low = std::max(this->low, other.low);
+        this->high = std::min(this->high, other.high);
+    }
+};
+
+/** Get the span of X coordinates for which `a * x + b` is in [min, max]. */
+Span solve_linear(float a, float b, float min, float max)
+{
+    constexpr auto infinity = std::numeric_limits<float>::infinity();
+
+    if (a == 0) {
+        if (b >= min && b <= max) {
+            return Span{-infinity, infinity};
+        }
+
+        return Span{};
+    }
+
+    float first = (min - b) / a;
+    float second = (max - b) / a;
+    return Span{std::min(first, second), std::max(first, second)};
+}
+
+/** Get the span of a row inside a disk. */
+Span disk_span(float x, float dy, float radius)
+{
+    float square = radius * radius - dy * dy;
+
+    if (square < 0) {
+        return Span{};
+    }
+
+    float half = std::sqrt(square);
+    return Span{x - half, x + half};
+}
+
+/**
+ * Draw a segment with round caps.
+ *
+ * The shape is the union of two disks on the endpoints and of a rectangle
+ * along the segment. Since it is convex, its intersection with each row is
+ * a single span, obtained by joining the spans of those three parts.
+ */
+void draw_segment(
+    Point start,
+    Point end,
+    float radius,
+    Intensity color,
+    Intensity* dest,
+    Region dest_region,
+    std::size_t dest_stride
+)
+{
+    const float ax = start.left;
+    const float ay = start.top;
+    const float bx = end.left;
+    const float by = end.top;
+
+    const float dx = bx - ax;
+    const float dy = by - ay;
+    const float length2 = dx * dx + dy * dy;
+    const float length = std::sqrt(length2);
+
+    // Rows that may be touched by the segment, restricted to the destination
+    const float first_row = std::ceil(std::min(ay, by) - radius);
+    const float last_row = std::floor(std::max(ay, by) + radius);
+
+    const auto top = static_cast<std::int64_t>(std::max(
+        first_row, static_cast<float>(dest_region.top)
+    ));
+    const auto bottom = static_cast<std::int64_t>(std::min(
+        last_row,
+        static_cast<float>(dest_region.top + dest_region.height) - 1
+    ));
+
+    const float left = dest_region.left;
+    const float right = dest_region.left + dest_region.width - 1.f;
+
+    for (auto y = top; y <= bottom; ++y) {
+        const float ry = y - ay;
+
+        Span span = disk_span(ax, ry, radius);
+        span.join(disk_span(bx, y - by, radius));
+
+        if (length2 > 0) {
+            // Project on the segment, then measure the distance to it
+            Span band = solve_linear(
+                dx / length2, (ry * dy - ax * dx) / length2, 0, 1
+            );
+            band.meet(solve_linear(
+                dy / length, (-ax * dy - ry * dx) / length, -radius, radius
+            ));
+            span.join(band);
+        }
+
+        span.meet(Span{left, right});
+
+        if (span.empty()) {
+            continue;
+        }
+
+        const auto low = static_cast<std::uint32_t>(std::ceil(span.low));
+        const auto high = static_cast<std::uint32_t>(std::floor(span.high));
+
+        if (low <= high) {
+            Intensity* row = dest
+                + (y - dest_region.top) * dest_stride
+                - dest_region.left;
+            std::fill(row + low, row + high + 1, color);
+        }
+    }
+}
+
+} // anonymous namespace
+
+namespace Waved
+{
+
+void draw_stroke(
+    const std::vector<Point>& points,
+    std::uint32_t width,
+    Intensity color,
+    Intensity* dest,
+    Region dest_region,
+    std::size_t dest_stride
+)
+{
+    if (points.empty() || dest_region.width == 0 || dest_region.height == 0) {
+        return;
+    }
+
+    const float radius = width / 2.f;
+
+    if (points.size() == 1) {
+        draw_segment(
+            points[0], points[0], radius, color,
+            dest, dest_region, dest_stride
+        );
+        return;
+    }
+
+    for (std::size_t i = 1; i < points.size(); ++i) {
+        draw_segment(
+            points[i - 1], points[i], radius, color,
+            dest, dest_region, dest_stride
+        );
+    }
+}
+
+Region stroke_bounds(
+    const std::vector<Point>& points,
+    std::uint32_t width,
+    Region clip
+)
+{
+    const std::uint32_t reach = width / 2;
+    std::uint32_t top = points[0].top;
+    std::uint32_t left = points[0].left;
+    std::uint32_t bottom = top;
+    std::uint32_t right = left;
+
+    for (const auto& point : points) {
+        top = std::min(top, point.top);
+        left = std::min(left, point.left);
+        bottom = std::max(bottom, point.top);
+        right = std::max(right, point.left);
+    }
+
+    top -= std::min(top - clip.top, reach);
+    left -= std::min(left - clip.left, reach);
+    bottom = std::min(bottom + reach, clip.top + clip.height - 1);
+    right = std::min(right + reach, clip.left + clip.width - 1);
+
+    return Region{top, left, right - left + 1, bottom - top + 1};
+}
+
+} // namespace Waved
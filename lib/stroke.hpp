@@ -0,0 +1,59 @@
+/**
+ * @file Rasterization of pen strokes.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_STROKE_HPP
+#define WAVED_STROKE_HPP
+
+#include "defs.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Waved
+{
+
+/**
+ * Draw a polyline with round caps and joins.
+ *
+ * Pixels whose center lies within `width / 2` of the polyline are set to
+ * the given color. Each row of a segment is filled as a single span, so
+ * the cost is proportional to the number of painted rows.
+ *
+ * @param points Points of the polyline, in the same coordinate system
+ * as the destination region. A single point draws a dot.
+ * @param width Diameter of the pen, in pixels.
+ * @param color Intensity to paint.
+ * @param dest Pointer to the top left pixel of the destination region.
+ * @param dest_region Coordinates of the destination region. Pixels outside
+ * of this region are left untouched.
+ * @param dest_stride Distance between two destination rows, in bytes.
+ */
+void draw_stroke(
+    const std::vector<Point>& points,
+    std::uint32_t width,
+    Intensity color,
+    Intensity* dest,
+    Region dest_region,
+    std::size_t dest_stride
+);
+
+/**
+ * Get the region covered by a polyline drawn with `draw_stroke()`.
+ *
+ * @param points Points of the polyline (at least one, all inside `clip`).
+ * @param width Diameter of the pen, in pixels.
+ * @param clip Region to which the result is restricted.
+ * @return Bounding rectangle of the painted pixels inside `clip`.
+ */
+Region stroke_bounds(
+    const std::vector<Point>& points,
+    std::uint32_t width,
+    Region clip
+);
+
+} // namespace Waved
+
+#endif // WAVED_STROKE_HPP
@@ -0,0 +1,614 @@
+/**
+ * @file
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "transform.hpp"
+#include <array>
+#include <cstring>
+
+namespace
+{
+
+using Waved::Intensity;
+using Waved::PixelFormat;
+
+// Side of the square tiles into which transposed blocks are split
+constexpr std::uint32_t tile_size = 16;
+
+// Mask used to truncate input values to valid intensities
+constexpr Intensity intensity_mask = Waved::intensity_values - 1;
+
+// Mask used to truncate gray levels to even intensities
+constexpr Intensity gray_mask = intensity_mask - 1;
+
+// Intensity of a full white pixel
+constexpr Intensity white = 30;
+
+// Side of the ordered dithering pattern
+constexpr std::uint32_t dither_size = 16;
+
+/**
+ * Build the thresholds of a Bayer ordered dithering pattern.
+ *
+ * A pixel is white if its intensity is above the threshold for its
+ * position. Each row is repeated twice so that any range of `dither_size`
+ * consecutive thresholds can be read from it without wrapping around.
+ */
+constexpr auto make_dither_thresholds()
+{
+    std::array<std::array<Intensity, 2 * dither_size>, dither_size> result{};
+
+    for (std::uint32_t y = 0; y < dither_size; ++y) {
+        for (std::uint32_t x = 0; x < dither_size; ++x) {
+            // Interleave the bits of x XOR y and y, from the least
+            // significant to the most significant position
+            std::uint32_t rank = 0;
+
+            for (std::uint32_t bit = 0; (1u << bit) < dither_size; ++bit) {
+                auto shift = 2 * (3 - bit);
+                rank |= (((x ^ y) >> bit) & 1) << (shift + 1);
+                rank |= ((y >> bit) & 1) << shift;
+            }
+
+            // Spread the ranks evenly over the range of gray levels
+            auto threshold = static_cast<Intensity>(
+                (2 * rank + 1) * white / (2 * dither_size * dither_size)
+            );
+            result[y][x] = threshold;
+            result[y][x + dither_size] = threshold;
+        }
+    }
+
+    return result;
+}
+
+constexpr auto dither_thresholds = make_dither_thresholds();
+
+/** Reduce an intensity to black or white depending on its position. */
+inline Intensity dither_pixel(Intensity value, Waved::Point position)
+{
+    const auto& row = dither_thresholds[position.top % dither_size];
+    return value > row[position.left % dither_size] ? white : 0;
+}
+
+/**
+ * Source block seen through a change of orientation.
+ *
+ * Pixel (i, j) of the oriented block is the pixel with index
+ * `col + j * col_step` in the row starting at `row + i * row_step`, with
+ * `col_step` equal to either 1 or -1.
+ */
+struct OrientedSource
+{
+    const std::uint8_t* row;
+    std::ptrdiff_t row_step;
+    std::ptrdiff_t col;
+    std::ptrdiff_t col_step;
+};
+
+/** Read a single pixel from a row and convert it to an intensity. */
+template<PixelFormat format>
+inline Intensity read_pixel(const std::uint8_t* row, std::ptrdiff_t index)
+{
+    if constexpr (format == PixelFormat::GRAY8) {
+        // Keep the 4 most significant bits as an even intensity
+        return (row[index] >> 3) & gray_mask;
+    } else if constexpr (format == PixelFormat::GRAY4) {
+        auto shift = (index & 1) ? 0 : 4;
+        return ((row[index >> 1] >> shift) & 0xF) << 1;
+    } else if constexpr (format == PixelFormat::GRAY1) {
+        auto shift = 7 - (index & 7);
+        return ((row[index >> 3] >> shift) & 1) ? white : 0;
+    } else {
+        return row[index] & intensity_mask;
+    }
+}
+
+/**
+ * Transpose a rectangle of destination pixels one by one.
+ *
+ * Used for the partial tiles on the edges of a block, and for whole
+ * blocks when vector instructions are not available.
+ */
+template<PixelFormat format, bool dither>
+void transpose_pixels(
+    OrientedSource source,
+    Intensity* dest,
+    std::size_t dest_stride,
+    Waved::Point origin,
+    std::uint32_t row_begin,
+    std::uint32_t row_end,
+    std::uint32_t col_begin,
+    std::uint32_t col_end
+)
+{
+    for (std::uint32_t r = row_begin; r < row_end; ++r) {
+        // Each destination row is an oriented source column
+        auto index = source.col + r * source.col_step;
+        Intensity* row = dest + r * dest_stride;
+
+        for (std::uint32_t c = col_begin; c < col_end; ++c) {
+            row[c] = read_pixel<format>(
+                source.row + c * source.row_step, index
+            );
+
+            if constexpr (dither) {
+                row[c] = dither_pixel(
+                    row[c], Waved::Point{origin.top + r, origin.left + c}
+                );
+            }
+        }
+    }
+}
+
+/**
+ * Copy a range of pixels from an oriented source row one by one.
+ *
+ * @param origin Screen position of the first pixel of the destination row.
+ */
+template<PixelFormat format, bool dither>
+void copy_pixels(
+    const std::uint8_t* row,
+    std::ptrdiff_t col,
+    std::ptrdiff_t col_step,
+    Intensity* dest,
+    Waved::Point origin,
+    std::uint32_t col_begin,
+    std::uint32_t col_end
+)
+{
+    for (std::uint32_t c = col_begin; c < col_end; ++c) {
+        dest[c] = read_pixel<format>(row, col + c * col_step);
+
+        if constexpr (dither) {
+            dest[c] = dither_pixel(
+                dest[c], Waved::Point{origin.top, origin.left + c}
+            );
+        }
+    }
+}
+
+#if defined(__GNUC__)
+#define WAVED_VECTOR_TRANSFORM
+
+// Vector holding a full tile row, seen as bytes or as pairs of bytes
+typedef std::uint8_t TileRow __attribute__((vector_size(tile_size)));
+typedef std::uint16_t TilePairs __attribute__((vector_size(tile_size)));
+
+#if defined(__clang__)
+#define WAVED_SHUFFLE(type, a, b, ...) \
+    __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define WAVED_SHUFFLE(type, a, b, ...) \
+    __builtin_shuffle(a, b, type{__VA_ARGS__})
+#endif
+
+/** Interleave the first halves of two tile rows. */
+inline TileRow interleave_low(TileRow a, TileRow b)
+{
+    return WAVED_SHUFFLE(
+        TileRow, a, b,
+        0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23
+    );
+}
+
+/** Interleave the second halves of two tile rows. */
+inline TileRow interleave_high(TileRow a, TileRow b)
+{
+    return WAVED_SHUFFLE(
+        TileRow, a, b,
+        8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31
+    );
+}
+
+/** Reverse the order of the pixels in a tile row. */
+inline TileRow reverse(TileRow a)
+{
+    // Swap the bytes in each pair, then reverse the order of the pairs.
+    // Unlike a single byte shuffle, this does not require SSSE3 on x86
+    auto pairs = reinterpret_cast<TilePairs>(a);
+    pairs = (pairs << 8) | (pairs >> 8);
+    pairs = WAVED_SHUFFLE(TilePairs, pairs, pairs, 7, 6, 5, 4, 3, 2, 1, 0);
+    return reinterpret_cast<TileRow>(pairs);
+}
+
+/**
+ * Read a full tile row from a source row and convert it to intensities.
+ *
+ * @param row Pointer to the start of the source row.
+ * @param index Index of the first pixel to read in the row.
+ */
+template<PixelFormat format>
+inline TileRow read_pixels(const std::uint8_t* row, std::ptrdiff_t index)
+{
+    TileRow result{};
+
+    if constexpr (format == PixelFormat::GRAY8) {
+        std::memcpy(&result, row + index, tile_size);
+        return (result >> 3) & gray_mask;
+    } else if constexpr (format == PixelFormat::GRAY4) {
+        // Split each byte into its two nibbles and interleave them. When
+        // starting on an odd pixel, read one more byte and shift by one
+        const bool odd = index & 1;
+        std::memcpy(&result, row + (index >> 1), tile_size / 2);
+
+        if (odd) {
+            result[tile_size / 2] = row[(index >> 1) + tile_size / 2];
+        }
+
+        TileRow high = result >> 4;
+        TileRow low = result & 0xF;
+        result = interleave_low(high, low);
+
+        if (odd) {
+            result = WAVED_SHUFFLE(
+                TileRow, result, interleave_high(high, low),
+                1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16
+            );
+        }
+
+        return result << 1;
+    } else if constexpr (format == PixelFormat::GRAY1) {
+        // Gather the 16 bits in a word and spread them, one per pixel
+        const unsigned shift = index & 7;
+        const std::uint8_t* bytes = row + (index >> 3);
+        std::uint32_t bits = (bytes[0] << 16) | (bytes[1] << 8);
+
+        if (shift) {
+            bits = (bits | bytes[2]) << shift;
+        }
+
+        result = WAVED_SHUFFLE(
+            TileRow,
+            TileRow{} + static_cast<std::uint8_t>(bits >> 16),
+            TileRow{} + static_cast<std::uint8_t>(bits >> 8),
+            0, 0, 0, 0, 0, 0, 0, 0, 16, 16, 16, 16, 16, 16, 16, 16
+        );
+
+        const TileRow masks{
+            128, 64, 32, 16, 8, 4, 2, 1,
+            128, 64, 32, 16, 8, 4, 2, 1
+        };
+
+        return reinterpret_cast<TileRow>((result & masks) != 0) & white;
+    } else {
+        std::memcpy(&result, row + index, tile_size);
+        return result & intensity_mask;
+    }
+}
+
+#undef WAVED_SHUFFLE
+
+/**
+ * Reduce a tile row to black and white depending on its position.
+ *
+ * @param position Screen position of the first pixel of the row.
+ */
+inline TileRow dither_pixels(TileRow pixels, Waved::Point position)
+{
+    TileRow thresholds;
+    std::memcpy(
+        &thresholds,
+        &dither_thresholds[position.top % dither_size]
+            [position.left % dither_size],
+        tile_size
+    );
+
+    return reinterpret_cast<TileRow>(pixels > thresholds) & white;
+}
+
+/**
+ * Read a full tile row from an oriented source row.
+ *
+ * @param row Pointer to the start of the source row.
+ * @param index Index of the pixel in the row that corresponds to the
+ * first pixel of the tile row.
+ * @param col_step Direction in which to read the source row.
+ */
+template<PixelFormat format>
+inline TileRow read_oriented_pixels(
+    const std::uint8_t* row,
+    std::ptrdiff_t index,
+    std::ptrdiff_t col_step
+)
+{
+    if (col_step < 0) {
+        // When reading backwards, start from the last pixel
+        return reverse(
+            read_pixels<format>(row, index - (tile_size - 1))
+        );
+    }
+
+    return read_pixels<format>(row, index);
+}
+
+/**
+ * Transpose a full tile using vector instructions.
+ *
+ * @param source Oriented source block.
+ * @param dest Pointer to the top-left pixel of the destination tile.
+ * @param row Index of the first destination row of the tile.
+ * @param col Index of the first destination column of the tile.
+ */
+template<PixelFormat format, bool dither>
+void transpose_tile(
+    OrientedSource source,
+    Intensity* dest,
+    std::size_t dest_stride,
+    Waved::Point origin,
+    std::uint32_t row,
+    std::uint32_t col
+)
+{
+    TileRow rows[tile_size];
+    TileRow next[tile_size];
+
+    // Destination rows are oriented source columns, so read a tile
+    // from the oriented source rows and transpose it. When reading the
+    // source rows backwards, read them forwards and reverse the order
+    // of the destination rows instead
+    const bool backwards = source.col_step < 0;
+    const std::uint8_t* first = source.row + col * source.row_step;
+    const auto index = source.col + row * source.col_step
+        - (backwards ? tile_size - 1 : 0);
+
+    for (std::uint32_t i = 0; i < tile_size; ++i) {
+        rows[i] = read_pixels<format>(first + i * source.row_step, index);
+    }
+
+    // Each round rotates the bits of the (row, column) index by one
+    // position, so that four rounds swap the row and column indices
+    for (int round = 0; round < 4; ++round) {
+        for (std::uint32_t i = 0; i < tile_size / 2; ++i) {
+            next[2 * i] = interleave_low(rows[i], rows[i + tile_size / 2]);
+            next[2 * i + 1] = interleave_high(
+                rows[i], rows[i + tile_size / 2]
+            );
+        }
+
+        std::memcpy(rows, next, sizeof(rows));
+    }
+
+    for (std::uint32_t i = 0; i < tile_size; ++i) {
+        TileRow pixels = rows[backwards ? tile_size - 1 - i : i];
+
+        if constexpr (dither) {
+            pixels = dither_pixels(
+                pixels, Waved::Point{origin.top + row + i, origin.left + col}
+            );
+        }
+
+        std::memcpy(dest + i * dest_stride, &pixels, tile_size);
+    }
+}
+#endif // __GNUC__
+
+/**
+ * Transpose an oriented source block.
+ *
+ * @param source Oriented source block.
+ * @param width Width of the destination (height of the source).
+ * @param height Height of the destination (width of the source).
+ * @param origin Screen position of the first destination pixel, used
+ * for aligning the dithering pattern.
+ */
+template<PixelFormat format, bool dither>
+void transpose_block(
+    OrientedSource source,
+    std::uint32_t width,
+    std::uint32_t height,
+    Intensity* dest,
+    std::size_t dest_stride,
+    Waved::Point origin
+)
+{
+    // Destination rows and columns covered by full tiles
+    const std::uint32_t full_rows = height - height % tile_size;
+    const std::uint32_t full_cols = width - width % tile_size;
+
+    for (std::uint32_t r = 0; r < full_rows; r += tile_size) {
+        for (std::uint32_t c = 0; c < full_cols; c += tile_size) {
+#ifdef WAVED_VECTOR_TRANSFORM
+            transpose_tile<format, dither>(
+                source, dest + r * dest_stride + c, dest_stride, origin, r, c
+            );
+#else
+            transpose_pixels<format, dither>(
+                source, dest, dest_stride, origin,
+                r, r + tile_size,
+                c, c + tile_size
+            );
+#endif // WAVED_VECTOR_TRANSFORM
+        }
+    }
+
+    // Partial tiles on the right and bottom edges
+    transpose_pixels<format, dither>(
+        source, dest, dest_stride, origin,
+        0, full_rows, full_cols, width
+    );
+
+    transpose_pixels<format, dither>(
+        source, dest, dest_stride, origin,
+        full_rows, height, 0, width
+    );
+}
+
+/** Copy an oriented source block row by row. */
+template<PixelFormat format, bool dither>
+void copy_block(
+    OrientedSource source,
+    std::uint32_t width,
+    std::uint32_t height,
+    Intensity* dest,
+    std::size_t dest_stride,
+    Waved::Point origin
+)
+{
+    for (std::uint32_t r = 0; r < height; ++r) {
+        const std::uint8_t* row = source.row + r * source.row_step;
+        const Waved::Point row_origin{origin.top + r, origin.left};
+        std::uint32_t c = 0;
+
+#ifdef WAVED_VECTOR_TRANSFORM
+        for (; c + tile_size <= width; c += tile_size) {
+            TileRow pixels = read_oriented_pixels<format>(
+                row, source.col + c * source.col_step, source.col_step
+            );
+
+            if constexpr (dither) {
+                pixels = dither_pixels(
+                    pixels,
+                    Waved::Point{row_origin.top, row_origin.left + c}
+                );
+            }
+
+            std::memcpy(dest + c, &pixels, tile_size);
+        }
+#endif // WAVED_VECTOR_TRANSFORM
+
+        copy_pixels<format, dither>(
+            row, source.col, source.col_step,
+            dest, row_origin, c, width
+        );
+
+        dest += dest_stride;
+    }
+}
+
+/** Transform a block of pixels stored in a given format. */
+template<PixelFormat format, bool dither>
+void transform_format(
+    const Waved::BufferView& source,
+    Waved::Orientation orientation,
+    std::uint32_t width,
+    std::uint32_t height,
+    Intensity* dest,
+    std::size_t dest_stride,
+    Waved::Point origin
+)
+{
+    using Waved::Orientation;
+
+    const auto stride = static_cast<std::ptrdiff_t>(source.stride);
+    const std::uint8_t* first_row = source.data;
+    const std::uint8_t* last_row = source.data + (height - 1) * stride;
+    const std::ptrdiff_t first_col = source.pixel_offset;
+    const std::ptrdiff_t last_col = source.pixel_offset + width - 1;
+
+    switch (orientation) {
+    case Orientation::ROTATE_0:
+        // Swap X and Y, flip X and Y
+        transpose_block<format, dither>(
+            OrientedSource{last_row, -stride, last_col, -1},
+            height, width, dest, dest_stride, origin
+        );
+        break;
+
+    case Orientation::ROTATE_90:
+        // Flip X
+        copy_block<format, dither>(
+            OrientedSource{first_row, stride, last_col, -1},
+            width, height, dest, dest_stride, origin
+        );
+        break;
+
+    case Orientation::ROTATE_180:
+        // Swap X and Y
+        transpose_block<format, dither>(
+            OrientedSource{first_row, stride, first_col, 1},
+            height, width, dest, dest_stride, origin
+        );
+        break;
+
+    case Orientation::ROTATE_270:
+        // Flip Y
+        copy_block<format, dither>(
+            OrientedSource{last_row, -stride, first_col, 1},
+            width, height, dest, dest_stride, origin
+        );
+        break;
+
+    case Orientation::EPD:
+        copy_block<format, dither>(
+            OrientedSource{first_row, stride, first_col, 1},
+            width, height, dest, dest_stride, origin
+        );
+        break;
+    }
+}
+
+/** Transform a block of pixels, dithering it if requested. */
+template<PixelFormat format>
+void transform_dither(
+    const Waved::BufferView& source,
+    Waved::Orientation orientation,
+    std::uint32_t width,
+    std::uint32_t height,
+    Intensity* dest,
+    std::size_t dest_stride,
+    std::optional<Waved::Point> dither
+)
+{
+    // Black and white pixels are left as is by dithering
+    if (dither && format != PixelFormat::GRAY1) {
+        transform_format<format, true>(
+            source, orientation, width, height, dest, dest_stride, *dither
+        );
+    } else {
+        transform_format<format, false>(
+            source, orientation, width, height, dest, dest_stride, {}
+        );
+    }
+}
+
+} // anonymous namespace
+
+namespace Waved
+{
+
+void transform_to_epd(
+    const BufferView& source,
+    std::uint32_t width,
+    std::uint32_t height,
+    Intensity* dest,
+    std::size_t dest_stride,
+    std::optional<Point> dither
+)
+{
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    auto orientation = source.orientation.value_or(Orientation::ROTATE_0);
+
+    switch (source.format) {
+    case PixelFormat::INTENSITY:
+        transform_dither<PixelFormat::INTENSITY>(
+            source, orientation, width, height, dest, dest_stride, dither
+        );
+        break;
+
+    case PixelFormat::GRAY8:
+        transform_dither<PixelFormat::GRAY8>(
+            source, orientation, width, height, dest, dest_stride, dither
+        );
+        break;
+
+    case PixelFormat::GRAY4:
+        transform_dither<PixelFormat::GRAY4>(
+            source, orientation, width, height, dest, dest_stride, dither
+        );
+        break;
+
+    case PixelFormat::GRAY1:
+        transform_dither<PixelFormat::GRAY1>(
+            source, orientation, width, height, dest, dest_stride, dither
+        );
+        break;
+    }
+}
+
+} // namespace Waved
@@ -0,0 +1,74 @@
+/**
+ * @file Conversion of caller-supplied pixel buffers to EPD coordinates.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_TRANSFORM_HPP
+#define WAVED_TRANSFORM_HPP
+
+#include "defs.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace Waved
+{
+
+/** Check whether an orientation swaps the X and Y axes of the EPD. */
+inline bool swaps_axes(Orientation orientation)
+{
+    return orientation == Orientation::ROTATE_0
+        || orientation == Orientation::ROTATE_180;
+}
+
+/** Get the number of bytes spanned by a row of pixels in a given format. */
+inline std::size_t row_size(PixelFormat format, std::uint32_t pixels)
+{
+    switch (format) {
+    case PixelFormat::GRAY4:
+        return (pixels + 1) / 2;
+
+    case PixelFormat::GRAY1:
+        return (pixels + 7) / 8;
+
+    default:
+        return pixels;
+    }
+}
+
+/**
+ * Transform a block of pixels to EPD coordinates.
+ *
+ * Depending on the source orientation, the block is transposed to swap the
+ * X and Y axes and/or flipped along each axis. Each pixel is converted from
+ * the source format to an intensity on the fly, so that the source is read
+ * exactly once. Transposition is done on square tiles so that both the
+ * source and the destination are accessed sequentially, and vector
+ * instructions are used when the compiler supports them.
+ *
+ * @param source View on the source pixels. If its orientation is unset,
+ * the usual portrait orientation is assumed.
+ * @param width Width of the source block.
+ * @param height Height of the source block.
+ * @param dest Pointer to the first destination pixel. May be equal to the
+ * source data for the EPD orientation and intensity format, provided that
+ * both strides are equal.
+ * @param dest_stride Distance between two destination rows, in bytes.
+ * @param dither If set, reduce the pixels to black and white using ordered
+ * dithering, for modes that only support those two levels. Gives the screen
+ * position of the first destination pixel, so that the dithering pattern
+ * stays aligned across blocks.
+ */
+void transform_to_epd(
+    const BufferView& source,
+    std::uint32_t width,
+    std::uint32_t height,
+    Intensity* dest,
+    std::size_t dest_stride,
+    std::optional<Point> dither = {}
+);
+
+} // namespace Waved
+
+#endif // WAVED_TRANSFORM_HPP
@@ -8,6 +8,7 @@
 #include "checksum.tpp"
 #include <algorithm>
 #include <fstream>
+#include <limits>
 #include <filesystem>
 #include <sstream>
 #include <set>
@@ -31,6 +32,13 @@ auto WaveformTable::lookup(ModeID mode, int temperature) const
         throw std::out_of_range(message.str());
     }
 
+    auto range = this->get_temperature_range(temperature);
+    return this->waveforms[waveform_lookup[mode][range]];
+}
+
+auto WaveformTable::get_temperature_range(int temperature) const
+-> std::size_t
+{
     std::vector<Temperature>::const_iterator it;
 
     if (temperature < -128) {
@@ -65,8 +73,7 @@ auto WaveformTable::lookup(ModeID mode, int temperature) const
         throw std::out_of_range(message.str());
     }
 
-    std::size_t range = it - this->temperatures.cbegin() - 1;
-    return this->waveforms[waveform_lookup[mode][range]];
+    return it - this->temperatures.cbegin() - 1;
 }
 
 auto WaveformTable::get_frame_rate() const -> std::uint8_t
@@ -103,14 +110,36 @@ auto WaveformTable::get_mode_id(ModeKind mode) const -> ModeID
     return id_iter->second;
 }
 
+auto find_transitions(const Waveform& waveform) -> TransitionSet
+{
+    TransitionSet result{};
+
+    for (Intensity from = 0; from < intensity_values; ++from) {
+        for (Intensity to = 0; to < intensity_values; ++to) {
+            result[from][to] = !std::all_of(
+                std::cbegin(waveform),
+                std::cend(waveform),
+                [from, to](const auto& matrix) {
+                    return matrix[from][to] == Phase::Noop;
+                }
+            );
+        }
+    }
+
+    return result;
+}
+
 namespace
 {
 
 /**
  * Use heuristics to classify a mode into a mode kind given
- * a sample waveform from that mode.
+ * a sample waveform from that mode and its set of transitions.
  */
-auto classify_mode_kind(const Waveform& waveform) -> ModeKind
+auto classify_mode_kind(
+    const Waveform& waveform,
+    const TransitionSet& transitions
+) -> ModeKind
 {
     // Detect INIT mode: transitions should be all the same regardless
     // of the initial or target intensity values
@@ -139,26 +168,11 @@ auto classify_mode_kind(const Waveform& waveform) -> ModeKind
         return ModeKind::INIT;
     }
 
-    // Detect which intensity transitions are no-ops
-    std::array<std::array<bool, intensity_values>, intensity_values> no_ops;
-
-    for (Intensity from = 0; from < intensity_values; ++from) {
-        for (Intensity to = 0; to < intensity_values; ++to) {
-            no_ops[from][to] = std::all_of(
-                std::cbegin(waveform),
-                std::cend(waveform),
-                [from, to](const auto& matrix) {
-                    return matrix[from][to] == Phase::Noop;
-                }
-            );
-        }
-    }
-
     // “Regal” waveforms support special transitions
     bool regalable = (
-        !no_ops[28][29] && !no_ops[28][31]
-        && !no_ops[29][29] && !no_ops[29][31]
-        && !no_ops[30][29] && !no_ops[30][31]
+        transitions[28][29] && transitions[28][31]
+        && transitions[29][29] && transitions[29][31]
+        && transitions[30][29] && transitions[30][31]
     );
 
     // Quantify the amount of supported intensities in sources and targets
@@ -169,7 +183,7 @@ auto classify_mode_kind(const Waveform& waveform) -> ModeKind
         bool is_defined = false;
 
         for (Intensity to = 0; to < intensity_values; ++to) {
-            if (!no_ops[from][to]) {
+            if (transitions[from][to]) {
                 ++defined_targets;
                 is_defined = true;
             }
@@ -217,7 +231,8 @@ void WaveformTable::populate_mode_kind_mappings()
     constexpr auto sample_temperature = 21;
 
     for (ModeID mode = 0; mode < this->mode_count; ++mode) {
-        auto kind = classify_mode_kind(this->lookup(mode, sample_temperature));
+        const auto& waveform = this->lookup(mode, sample_temperature);
+        auto kind = classify_mode_kind(waveform, find_transitions(waveform));
 
         if (kind == ModeKind::UNKNOWN) {
             std::cerr << "[warn] Could not detect mode kind for mode #"
@@ -233,6 +248,97 @@ void WaveformTable::populate_mode_kind_mappings()
 namespace
 {
 
+/** Make a waveform leave cells whose intensity does not change alone. */
+auto remove_flashes(Waveform waveform) -> Waveform
+{
+    for (auto& matrix : waveform) {
+        for (Intensity value = 0; value < intensity_values; ++value) {
+            matrix[value][value] = Phase::Noop;
+        }
+    }
+
+    return waveform;
+}
+
+/** Remove the frames at the end of a waveform that leave all cells alone. */
+auto trim_noops(Waveform waveform) -> Waveform
+{
+    while (
+        waveform.size() > 1
+        && std::all_of(
+            waveform.back().cbegin(), waveform.back().cend(),
+            [](const auto& row) {
+                return std::all_of(
+                    row.cbegin(), row.cend(),
+                    [](Phase phase) { return phase == Phase::Noop; }
+                );
+            }
+        )
+    ) {
+        waveform.pop_back();
+    }
+
+    return waveform;
+}
+
+} // anonymous namespace
+
+void WaveformTable::add_derived_modes()
+{
+    const std::pair<ModeKind, ModeKind> derived_kinds[] = {
+        {ModeKind::GC16, ModeKind::GL16},
+        {ModeKind::A2, ModeKind::A2_TRIMMED},
+        {ModeKind::DU, ModeKind::DU_TRIMMED},
+    };
+
+    for (const auto& [base_kind, kind] : derived_kinds) {
+        auto base = this->mode_id_by_kind.find(base_kind);
+
+        if (
+            base == this->mode_id_by_kind.end()
+            || this->mode_id_by_kind.count(kind)
+            || this->mode_count == std::numeric_limits<ModeID>::max()
+        ) {
+            continue;
+        }
+
+        // Derive each waveform of the base mode once, reusing the
+        // original waveform when the derivation leaves it unchanged
+        std::unordered_map<std::size_t, std::size_t> derived_waveforms;
+        std::vector<std::size_t> temp_lookup;
+
+        for (auto index : this->waveform_lookup[base->second]) {
+            auto it = derived_waveforms.find(index);
+
+            if (it == derived_waveforms.end()) {
+                const auto& waveform = this->waveforms[index];
+                auto derived = trim_noops(
+                    kind == ModeKind::GL16 ? remove_flashes(waveform) : waveform
+                );
+                auto derived_index = index;
+
+                if (derived != waveform) {
+                    derived_index = this->waveforms.size();
+                    this->waveforms.emplace_back(std::move(derived));
+                }
+
+                it = derived_waveforms.insert({index, derived_index}).first;
+            }
+
+            temp_lookup.push_back(it->second);
+        }
+
+        ModeID mode = this->mode_count++;
+        this->waveform_lookup.emplace_back(std::move(temp_lookup));
+
+        this->mode_kind_by_id.push_back(kind);
+        this->mode_id_by_kind.insert({kind, mode});
+    }
+}
+
+namespace
+{
+
 /**
  * WBF file decoding.
  *
@@ -658,6 +764,7 @@ auto WaveformTable::from_wbf(std::istream& file) -> WaveformTable
     result.waveforms = std::move(waveforms.first);
     result.waveform_lookup = std::move(waveforms.second);
     result.populate_mode_kind_mappings();
+    result.add_derived_modes();
     return result;
 }
 
@@ -67,6 +67,17 @@ public:
      */
     const Waveform& lookup(ModeID mode, int temperature) const;
 
+    /**
+     * Find the temperature range containing a given temperature.
+     *
+     * Waveforms only change when the temperature moves to another range.
+     *
+     * @param temperature Temperature in Celsius.
+     * @return Index of the range.
+     * @throws std::out_of_range If the given temperature is not supported.
+     */
+    std::size_t get_temperature_range(int temperature) const;
+
     using Lookup = std::vector<std::vector<std::size_t>>;
 
     /** Get the display frame rate. */
@@ -75,7 +86,12 @@ public:
     /** Get the available operating temperature thresholds. */
     const std::vector<Temperature>& get_temperatures() const;
 
-    /** Get the number of available modes. */
+    /**
+     * Get the number of available modes.
+     *
+     * Modes read from the WBF file come first, followed by modes derived
+     * from them.
+     */
     ModeID get_mode_count() const;
 
     /** Get the mode kind for a given mode ID. */
@@ -107,6 +123,13 @@ private:
      */
     void populate_mode_kind_mappings();
 
+    /**
+     * Add modes derived from the GC16, A2 and DU modes read from the
+     * file, if available (see ModeKind::GL16, ModeKind::A2_TRIMMED and
+     * ModeKind::DU_TRIMMED).
+     */
+    void add_derived_modes();
+
     // Set of temperature thresholds
     // The last value is the maximal operating temperature
     std::vector<Temperature> temperatures;
@@ -120,5 +143,8 @@ private:
     Lookup waveform_lookup;
 }; // class WaveformTable
 
+/** Find which intensity transitions are not no-ops in a waveform. */
+TransitionSet find_transitions(const Waveform& waveform);
+
 } // namespace Waved
 #endif // WAVED_WAVEFORM_TABLE_HPP
@@ -16,6 +16,10 @@ def parse_updates_csv(in_file):
         update["vsync_times"] = \
             list(map(int, update["vsync_times"].split(":"))) \
             if update["vsync_times"] else []
+        update["power_times"] = \
+            list(map(int, update["power_times"].split(":"))) \
+            if update.get("power_times") else []
+        update["hinted"] = update.get("hinted") == "1"
         update["start"] = update["queue_time"]
         update["end"] = update["vsync_times"][-1] \
             if update["vsync_times"] else update["generate_times"][-1]
@@ -9,7 +9,8 @@ on each row:
 * a diamond shape marking the time of insertion of the update into the queue,
 * a red rectangle that spans the update pre-processing step,
 * a green rectangle that spans the frame generation step,
-* a blue rectangle that spans the vsync step.
+* a blue rectangle that spans the vsync step,
+* a yellow rectangle that spans the display power-up, if it was off.
 """
 import sys
 import argparse
@@ -74,6 +75,9 @@ height="{len(updates) * UPDATE_ROW_HEIGHT}">
     .update-vsync-odd {{
         fill: #2222aa;
     }}
+    .update-power {{
+        fill: #ddcc33;
+    }}
 ]]></style>""", file=out)
 
     # Add alternating row stripes
@@ -139,6 +143,18 @@ height="{UPDATE_ROW_HEIGHT}" \
 class="update-vsync-{"even" if x % 2 == 0 else "odd"}"><title>\
 Update #{update["id"]} — Vsync frame #{x} — \
 {round((end - start) / 1_000)} ms\
+</title></rect>""", file=out)
+
+        # Add rectangle for the display power-up time
+        if update["power_times"]:
+            start, end = update["power_times"]
+            print(f"""<rect x="{time_to_x(start)}" \
+y="{y * UPDATE_ROW_HEIGHT}" \
+width="{delta_to_x(start, end)}" \
+height="{UPDATE_ROW_HEIGHT}" \
+class="update-power"><title>\
+Update #{update["id"]} — Power up — \
+{round((end - start) / 1_000)} ms\
 </title></rect>""", file=out)
 
         # Add diamond for time where the update was queued
@@ -0,0 +1,1056 @@
+/**
+ * @file Microbenchmarks for the update pipeline.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "display.hpp"
+#include "frame_sink.hpp"
+#include "transform.hpp"
+#include "waveform_table.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+#include "checksum.tpp"
+
+namespace chrono = std::chrono;
+
+/** Sizes of the benchmarked regions, from pen strokes to full screen. */
+const std::vector<std::pair<std::uint32_t, std::uint32_t>> region_sizes{
+    {8, 8},
+    {32, 32},
+    {128, 128},
+    {512, 512},
+    {1404, 1872},
+};
+
+/** Minimum time to spend repeating each measurement. */
+constexpr chrono::milliseconds min_duration{250};
+
+/** Measure the average running time of a function, in microseconds. */
+template<typename Function>
+double measure(Function function)
+{
+    std::size_t iterations = 0;
+    auto start = chrono::steady_clock::now();
+    chrono::steady_clock::duration elapsed;
+
+    do {
+        function();
+        ++iterations;
+        elapsed = chrono::steady_clock::now() - start;
+    } while (elapsed < min_duration);
+
+    return chrono::duration<double, std::micro>(elapsed).count()
+        / iterations;
+}
+
+/**
+ * Measure the average running time of a function, in microseconds,
+ * excluding the time taken by the setup function called before each run.
+ */
+template<typename Setup, typename Function>
+double measure(Setup setup, Function function)
+{
+    std::size_t iterations = 0;
+    auto start = chrono::steady_clock::now();
+    chrono::steady_clock::duration measured{0};
+
+    do {
+        setup();
+        auto run_start = chrono::steady_clock::now();
+        function();
+        measured += chrono::steady_clock::now() - run_start;
+        ++iterations;
+    } while (chrono::steady_clock::now() - start < min_duration);
+
+    return chrono::duration<double, std::micro>(measured).count()
+        / iterations;
+}
+
+/**
+ * Printer for benchmark results, either as aligned text or as CSV
+ * with the following columns:
+ *
+ * - benchmark: name of the measured function
+ * - variant: name of the measured case (orientation, mode, …)
+ * - width, height: size of the input, in pixels, or in bytes with a height
+ *   of 1 for byte buffers
+ * - time_us: average running time, in microseconds
+ */
+class Report
+{
+public:
+    Report(std::ostream& out, bool csv)
+    : out(out)
+    , csv(csv)
+    {
+        if (this->csv) {
+            this->out << "benchmark,variant,width,height,time_us\n";
+        } else {
+            this->out << std::fixed << std::setprecision(3);
+        }
+    }
+
+    void add(
+        const std::string& benchmark,
+        const std::string& variant,
+        std::uint32_t width,
+        std::uint32_t height,
+        double time
+    )
+    {
+        if (this->csv) {
+            this->out << benchmark << ',' << variant << ','
+                << width << ',' << height << ',' << time << '\n';
+        } else {
+            this->out << std::left << std::setw(18) << benchmark << ' '
+                << std::setw(14) << variant << std::right
+                << std::setw(8) << width << 'x'
+                << std::left << std::setw(4) << height << std::right
+                << std::setw(14) << time << " µs\n";
+        }
+
+        this->out.flush();
+    }
+
+private:
+    std::ostream& out;
+    bool csv;
+}; // class Report
+
+/**
+ * Reference pixel-by-pixel transform, which computes the source
+ * coordinates of each destination pixel and reads the source column-wise.
+ */
+void reference_transform(
+    const Waved::Intensity* source,
+    std::uint32_t width,
+    std::uint32_t height,
+    Waved::Intensity* dest
+)
+{
+    for (std::size_t k = 0; k < width * height; ++k) {
+        std::size_t i = height - (k % height) - 1;
+        std::size_t j = width - (k / height) - 1;
+        dest[k] = source[i * width + j] & (Waved::intensity_values - 1);
+    }
+}
+
+/** Measure the reference and tiled transforms on each region size. */
+void bench_transform(Report& report)
+{
+    std::mt19937 generator(424242);
+    std::uniform_int_distribution<int> distrib(0, 255);
+
+    for (const auto& [width, height] : region_sizes) {
+        std::vector<Waved::Intensity> source(width * height);
+        std::vector<Waved::Intensity> dest(width * height);
+
+        for (auto& value : source) {
+            value = distrib(generator);
+        }
+
+        report.add("transform", "reference", width, height, measure([&] {
+            reference_transform(source.data(), width, height, dest.data());
+        }));
+
+        report.add("transform", "tiled", width, height, measure([&] {
+            Waved::transform_to_epd(
+                Waved::BufferView{
+                    source.data(), width, Waved::PixelFormat::INTENSITY, 0,
+                    Waved::Orientation::ROTATE_0
+                },
+                width, height,
+                dest.data(), height
+            );
+        }));
+    }
+}
+
+/** Decode a single pixel of a source block, without any vector tricks. */
+Waved::Intensity reference_pixel(
+    const Waved::BufferView& source,
+    std::uint32_t x,
+    std::uint32_t y
+)
+{
+    const std::uint8_t* row = source.data + y * source.stride;
+    auto index = x + source.pixel_offset;
+
+    switch (source.format) {
+    case Waved::PixelFormat::GRAY8:
+        return (row[index] / 16) * 2;
+
+    case Waved::PixelFormat::GRAY4:
+        return (index % 2 == 0 ? row[index / 2] / 16 : row[index / 2] % 16)
+            * 2;
+
+    case Waved::PixelFormat::GRAY1:
+        return (row[index / 8] & (0x80 >> (index % 8))) ? 30 : 0;
+
+    default:
+        return row[index] % Waved::intensity_values;
+    }
+}
+
+/** Rank of a cell in the standard recursive Bayer matrix of a given size. */
+std::uint32_t bayer_rank(std::uint32_t x, std::uint32_t y, std::uint32_t size)
+{
+    constexpr std::uint32_t base[2][2] = {{0, 2}, {3, 1}};
+
+    if (size == 1) {
+        return 0;
+    }
+
+    return base[y % 2][x % 2] * (size / 2) * (size / 2)
+        + bayer_rank(x / 2, y / 2, size / 2);
+}
+
+/**
+ * Reference pixel-by-pixel transform for any orientation and format,
+ * which maps each source pixel to its EPD position independently.
+ */
+void reference_transform(
+    const Waved::BufferView& source,
+    std::uint32_t width,
+    std::uint32_t height,
+    Waved::Intensity* dest,
+    std::size_t dest_stride,
+    std::optional<Waved::Point> dither
+)
+{
+    constexpr std::uint32_t dither_size = 16;
+    constexpr Waved::Intensity white = 30;
+
+    for (std::uint32_t y = 0; y < height; ++y) {
+        for (std::uint32_t x = 0; x < width; ++x) {
+            std::uint32_t row = y;
+            std::uint32_t col = x;
+
+            switch (*source.orientation) {
+            case Waved::Orientation::ROTATE_0:
+                row = width - 1 - x;
+                col = height - 1 - y;
+                break;
+
+            case Waved::Orientation::ROTATE_90:
+                col = width - 1 - x;
+                break;
+
+            case Waved::Orientation::ROTATE_180:
+                row = x;
+                col = y;
+                break;
+
+            case Waved::Orientation::ROTATE_270:
+                row = height - 1 - y;
+                break;
+
+            case Waved::Orientation::EPD:
+                break;
+            }
+
+            auto value = reference_pixel(source, x, y);
+
+            if (dither) {
+                auto rank = bayer_rank(
+                    (dither->left + col) % dither_size,
+                    (dither->top + row) % dither_size,
+                    dither_size
+                );
+                auto threshold = (2 * rank + 1) * white
+                    / (2 * dither_size * dither_size);
+                value = value > threshold ? white : 0;
+            }
+
+            dest[row * dest_stride + col] = value;
+        }
+    }
+}
+
+/**
+ * Check the tiled transform against the reference for each orientation,
+ * pixel format, pixel offset and dithering setting, on each region size
+ * and on a size that leaves partial tiles.
+ *
+ * @return False if any result differs from the reference.
+ */
+bool check_transforms()
+{
+    const Waved::Orientation orientations[] = {
+        Waved::Orientation::ROTATE_0,
+        Waved::Orientation::ROTATE_90,
+        Waved::Orientation::ROTATE_180,
+        Waved::Orientation::ROTATE_270,
+        Waved::Orientation::EPD,
+    };
+
+    const Waved::PixelFormat formats[] = {
+        Waved::PixelFormat::INTENSITY,
+        Waved::PixelFormat::GRAY8,
+        Waved::PixelFormat::GRAY4,
+        Waved::PixelFormat::GRAY1,
+    };
+
+    auto sizes = region_sizes;
+    sizes.emplace_back(37, 21);
+
+    std::mt19937 generator(424242);
+    std::uniform_int_distribution<int> distrib(0, 255);
+    bool success = true;
+
+    for (const auto& [width, height] : sizes) {
+        for (auto format : formats) {
+            for (std::uint8_t offset : {0, 3}) {
+                auto stride = Waved::row_size(format, width + offset);
+                std::vector<std::uint8_t> source(stride * height);
+
+                for (auto& value : source) {
+                    value = distrib(generator);
+                }
+
+                for (auto orientation : orientations) {
+                    for (bool dither : {false, true}) {
+                        Waved::BufferView view{
+                            source.data(), stride, format, offset, orientation
+                        };
+                        auto dest_stride = Waved::swaps_axes(orientation)
+                            ? height : width;
+                        auto origin = dither
+                            ? std::optional<Waved::Point>{{5, 11}}
+                            : std::nullopt;
+
+                        std::vector<Waved::Intensity> expected(width * height);
+                        std::vector<Waved::Intensity> actual(width * height);
+
+                        reference_transform(
+                            view, width, height,
+                            expected.data(), dest_stride, origin
+                        );
+                        Waved::transform_to_epd(
+                            view, width, height,
+                            actual.data(), dest_stride, origin
+                        );
+
+                        if (expected != actual) {
+                            std::cerr << "[error] Transform of " << width
+                                << 'x' << height << " (format "
+                                << static_cast<int>(format) << ", offset "
+                                << static_cast<int>(offset)
+                                << ", orientation "
+                                << static_cast<int>(orientation)
+                                << (dither ? ", dithered" : "")
+                                << ") differs from the reference\n";
+                            success = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return success;
+}
+
+/** Measure the tiled transform for each orientation on each region size. */
+void bench_orientations(Report& report)
+{
+    const std::pair<Waved::Orientation, const char*> orientations[] = {
+        {Waved::Orientation::ROTATE_0, "rotate_0"},
+        {Waved::Orientation::ROTATE_90, "rotate_90"},
+        {Waved::Orientation::ROTATE_180, "rotate_180"},
+        {Waved::Orientation::ROTATE_270, "rotate_270"},
+        {Waved::Orientation::EPD, "epd"},
+    };
+
+    for (const auto& [width, height] : region_sizes) {
+        std::vector<Waved::Intensity> source(width * height);
+        std::vector<Waved::Intensity> dest(width * height);
+
+        for (const auto& [orientation, name] : orientations) {
+            auto dest_width = Waved::swaps_axes(orientation) ? height : width;
+            report.add("orientation", name, width, height, measure([&] {
+                Waved::transform_to_epd(
+                    Waved::BufferView{
+                        source.data(), width,
+                        Waved::PixelFormat::INTENSITY, 0, orientation
+                    },
+                    width, height,
+                    dest.data(), dest_width
+                );
+            }));
+        }
+    }
+}
+
+/** Measure the portrait transform for each input pixel format. */
+void bench_formats(Report& report)
+{
+    const std::pair<Waved::PixelFormat, const char*> formats[] = {
+        {Waved::PixelFormat::INTENSITY, "intensity"},
+        {Waved::PixelFormat::GRAY8, "gray8"},
+        {Waved::PixelFormat::GRAY4, "gray4"},
+        {Waved::PixelFormat::GRAY1, "gray1"},
+    };
+
+    for (const auto& [width, height] : region_sizes) {
+        std::vector<Waved::Intensity> dest(width * height);
+
+        for (const auto& [format, name] : formats) {
+            auto stride = Waved::row_size(format, width);
+            std::vector<std::uint8_t> source(stride * height);
+            report.add("format", name, width, height, measure([&] {
+                Waved::transform_to_epd(
+                    Waved::BufferView{source.data(), stride, format},
+                    width, height,
+                    dest.data(), height
+                );
+            }));
+        }
+    }
+}
+
+/** Measure the WBF parser and the CRC32 checksum it uses. */
+void bench_wbf(Report& report, const std::string& contents)
+{
+    auto size = static_cast<std::uint32_t>(contents.size());
+
+    report.add("from_wbf", "memory", size, 1, measure([&] {
+        std::istringstream stream{contents};
+        Waved::WaveformTable::from_wbf(stream);
+    }));
+
+    for (std::uint32_t length : {4096u, 65536u, 1048576u}) {
+        std::vector<std::uint8_t> buffer(length, 0x5A);
+        volatile std::uint32_t result = 0;
+
+        report.add("crc32", "table", length, 1, measure([&] {
+            result = Waved::crc32_checksum(0, buffer.cbegin(), buffer.cend());
+        }));
+    }
+}
+
+namespace Waved
+{
+
+/**
+ * Microbenchmarks of the update processing steps, run on a display that
+ * sends its frames to memory and is never started.
+ */
+class DisplayBench
+{
+public:
+    explicit DisplayBench(WaveformTable table)
+    // The temperature sensor is only read when the display is started
+    : display(std::make_unique<MemorySink>(), "/dev/null", std::move(table))
+    {
+        const auto& temperatures = this->display.table.get_temperatures();
+
+        this->display.generate_waveforms = this->display.resolve_waveforms(
+            temperatures[(temperatures.size() - 1) / 2]
+        );
+
+        std::mt19937 generator(424242);
+        std::uniform_int_distribution<int> distrib(0, 15);
+
+        for (auto& value : this->display.current_intensity) {
+            value = distrib(generator) * 2;
+        }
+
+        for (auto& value : this->random_intensities) {
+            value = distrib(generator) * 2;
+        }
+
+        for (
+            ModeID mode = 0;
+            mode < this->display.table.get_mode_count();
+            ++mode
+        ) {
+            if (this->display.table.get_mode_kind(mode) == ModeKind::GC16) {
+                this->gc16_mode = mode;
+            }
+        }
+    }
+
+    void run(Report& report)
+    {
+        this->bench_merge(report);
+        this->bench_align(report);
+        this->bench_check_consecutive(report);
+        this->bench_generate_frames(report);
+        this->bench_commit(report);
+    }
+
+private:
+    Display display;
+
+    // Intensity of white cells
+    static constexpr Intensity white = 30;
+
+    // Source of the intensities rendered by the updates
+    std::array<Intensity, Display::epd_size> random_intensities{};
+
+    // Mode used by updates of the benchmarks that don’t depend on it
+    ModeID gc16_mode = 0;
+
+    /**
+     * Get a region of the given size, in the EPD coordinate system, at
+     * the bottom left of the screen in the portrait orientation.
+     */
+    static Region epd_region(std::uint32_t width, std::uint32_t height)
+    {
+        return Region{
+            /* top = */ 0,
+            /* left = */ 0,
+            /* width = */ height,
+            /* height = */ width
+        };
+    }
+
+    /** Start a new current update covering a region. */
+    void reset_update(const Region& region, ModeID mode)
+    {
+        auto& update = this->display.generate_update;
+        update = Display::Update{};
+        update.mode = mode;
+        update.region = region;
+    }
+
+    /** Render the current update from the random intensities. */
+    void fill_buffer()
+    {
+        auto& update = this->display.generate_update;
+        const auto& region = update.region;
+        update.buffer.resize(region.width * region.height);
+
+        for (std::uint32_t y = 0; y < region.height; ++y) {
+            const auto* source = this->random_intensities.data()
+                + (region.top + y) * Display::epd_width + region.left;
+
+            std::copy(
+                source, source + region.width,
+                update.buffer.begin() + y * region.width
+            );
+        }
+    }
+
+    /** Merge a burst of queued fills into the current update. */
+    void bench_merge(Report& report)
+    {
+        constexpr std::size_t burst = 16;
+
+        for (const auto& [width, height] : region_sizes) {
+            auto region = epd_region(width, height);
+            auto time = measure([&] {
+                this->reset_update(region, this->gc16_mode);
+                this->display.generate_update.layers.push_back(
+                    Display::Layer{region, {}, {}, {}, {}, {}}
+                );
+                this->display.pending_updates.clear();
+
+                for (std::size_t i = 0; i < burst; ++i) {
+                    Display::Update next;
+                    next.mode = this->gc16_mode;
+                    next.region = region;
+                    next.layers.push_back(
+                        Display::Layer{region, {}, {}, white, {}, {}}
+                    );
+                    this->display.pending_updates.push_back(std::move(next));
+                }
+            }, [&] {
+                while (this->display.merge_update());
+            });
+
+            report.add("merge_update", "burst16", width, height, time);
+        }
+
+        this->display.pending_updates.clear();
+    }
+
+    /** Align unaligned regions to the cell groups of the frames. */
+    void bench_align(Report& report)
+    {
+        for (const auto& [width, height] : region_sizes) {
+            auto region = epd_region(width, height);
+
+            if (region.width + 3 <= Display::epd_width) {
+                region.left = 3;
+            }
+
+            auto time = measure([&] {
+                this->display.generate_update.region = region;
+            }, [&] {
+                this->display.align_update();
+            });
+
+            report.add("align_update", "left3", width, height, time);
+        }
+    }
+
+    /** Find repeated cell groups in random and in uniform updates. */
+    void bench_check_consecutive(Report& report)
+    {
+        for (const auto& [width, height] : region_sizes) {
+            auto region = epd_region(width, height);
+            this->reset_update(region, this->gc16_mode);
+            this->fill_buffer();
+
+            report.add(
+                "check_consecutive", "random", width, height,
+                measure([&] { this->display.check_consecutive(); })
+            );
+
+            auto& buffer = this->display.generate_update.buffer;
+            std::fill(buffer.begin(), buffer.end(), white);
+
+            report.add(
+                "check_consecutive", "uniform", width, height,
+                measure([&] { this->display.check_consecutive(); })
+            );
+        }
+    }
+
+    /** Generate the frames of an update for each mode. */
+    void bench_generate_frames(Report& report)
+    {
+        const auto& table = this->display.table;
+
+        for (const auto& [width, height] : region_sizes) {
+            auto region = epd_region(width, height);
+
+            for (ModeID mode = 0; mode < table.get_mode_count(); ++mode) {
+                // Several modes can share the same kind
+                auto name = std::to_string(mode) + ':'
+                    + mode_kind_to_string(table.get_mode_kind(mode));
+
+                this->reset_update(region, mode);
+                this->fill_buffer();
+
+                report.add(
+                    "generate_frames", name, width, height,
+                    measure([&] { this->display.generate_frames(); })
+                );
+            }
+        }
+
+        this->display.generate_buffer.clear();
+        this->display.generate_buffer.shrink_to_fit();
+    }
+
+    /** Commit a rendered update to the current intensities. */
+    void bench_commit(Report& report)
+    {
+        for (const auto& [width, height] : region_sizes) {
+            auto region = epd_region(width, height);
+            this->reset_update(region, this->gc16_mode);
+            this->fill_buffer();
+
+            report.add(
+                "commit_update", "buffer", width, height,
+                measure([&] { this->display.commit_update(); })
+            );
+        }
+    }
+}; // class DisplayBench
+
+} // namespace Waved
+
+/** Sink that counts the frames it forwards to another sink. */
+class CountingSink : public Waved::FrameSink
+{
+public:
+    explicit CountingSink(std::unique_ptr<Waved::FrameSink> sink)
+    : sink(std::move(sink))
+    {}
+
+    void start(const Waved::Frame& null_frame) override
+    {
+        this->sink->start(null_frame);
+    }
+
+    void stop() override
+    {
+        this->sink->stop();
+    }
+
+    bool set_power(bool power_state) override
+    {
+        return this->sink->set_power(power_state);
+    }
+
+    void send_frame(const Waved::Frame& frame) override
+    {
+        this->sink->send_frame(frame);
+
+        {
+            std::lock_guard<std::mutex> lock(this->count_lock);
+            ++this->count;
+        }
+
+        this->count_cv.notify_all();
+    }
+
+    /** Get the number of frames sent since the sink was created. */
+    std::size_t get_frame_count()
+    {
+        std::lock_guard<std::mutex> lock(this->count_lock);
+        return this->count;
+    }
+
+    /**
+     * Wait until a given number of frames were sent since the sink
+     * was created.
+     *
+     * @return False if the frames were not sent within the timeout.
+     */
+    bool wait_frames(std::size_t total, chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(this->count_lock);
+        return this->count_cv.wait_for(lock, timeout, [this, total] {
+            return this->count >= total;
+        });
+    }
+
+private:
+    std::unique_ptr<Waved::FrameSink> sink;
+
+    // Number of frames sent (guarded by count_lock)
+    std::size_t count = 0;
+    std::condition_variable count_cv;
+    std::mutex count_lock;
+}; // class CountingSink
+
+/**
+ * Temporary file holding a fixed panel temperature, for displays that
+ * don’t drive an actual panel.
+ */
+class TemperatureFile
+{
+public:
+    /** @throws std::system_error If the file cannot be created. */
+    explicit TemperatureFile(int temperature)
+    {
+        char path[] = "/tmp/waved-bench-XXXXXX";
+        Waved::FileDescriptor fd{mkstemp(path)};
+
+        if (fd == -1) {
+            throw std::system_error(
+                errno, std::generic_category(), "Create temperature file"
+            );
+        }
+
+        this->path = path;
+        auto contents = std::to_string(temperature) + '\n';
+
+        if (
+            write(fd, contents.data(), contents.size())
+            != static_cast<ssize_t>(contents.size())
+        ) {
+            unlink(path);
+            throw std::system_error(
+                errno, std::generic_category(), "Write temperature file"
+            );
+        }
+    }
+
+    TemperatureFile(const TemperatureFile&) = delete;
+    TemperatureFile& operator=(const TemperatureFile&) = delete;
+
+    ~TemperatureFile()
+    {
+        unlink(this->path.data());
+    }
+
+    const char* get_path() const
+    {
+        return this->path.data();
+    }
+
+private:
+    std::string path;
+}; // class TemperatureFile
+
+/** Check whether a name designates one of the supported frame sinks. */
+bool is_valid_sink(const std::string& name)
+{
+    return name == "memory"
+        || name == "mxsfb"
+        || name == "emulated"
+        || (name.rfind("file:", 0) == 0 && name.size() > 5);
+}
+
+/**
+ * Measure the time taken to push updates to a started display and send
+ * all their frames, for each mode on each region size.
+ *
+ * @param sink_name Frame sink to use (see `print_help()`).
+ * @param contents Contents of the WBF file.
+ * @return False if the benchmark could not be run, or if the emulated
+ * sink detected frames sent unsafely.
+ */
+bool bench_pipeline(
+    Report& report,
+    const std::string& sink_name,
+    const std::string& contents
+)
+{
+    std::istringstream stream{contents};
+    auto table = Waved::WaveformTable::from_wbf(stream);
+    const auto& temperatures = table.get_temperatures();
+    int temperature = temperatures[(temperatures.size() - 1) / 2];
+
+    std::unique_ptr<Waved::FrameSink> sink;
+    std::optional<TemperatureFile> temperature_file;
+    std::string sensor_path;
+
+    // Sink owned by the display, if it is emulated
+    Waved::EmulatedMxsfbSink* emulated = nullptr;
+
+    if (sink_name == "mxsfb") {
+        auto framebuffer_path = Waved::Display::discover_framebuffer();
+        auto found_sensor = Waved::Display::discover_temperature_sensor();
+
+        if (!framebuffer_path || !found_sensor) {
+            std::cerr << "[error] Cannot find the framebuffer device or "
+                "the temperature sensor\n";
+            return false;
+        }
+
+        sink = std::make_unique<Waved::MxsfbSink>(framebuffer_path->data());
+        sensor_path = *found_sensor;
+        std::ifstream{sensor_path} >> temperature;
+    } else {
+        if (sink_name == "memory") {
+            sink = std::make_unique<Waved::MemorySink>();
+        } else if (sink_name == "emulated") {
+            auto emulated_sink = std::make_unique<Waved::EmulatedMxsfbSink>(
+                table.get_frame_rate()
+            );
+            emulated = emulated_sink.get();
+            sink = std::move(emulated_sink);
+        } else {
+            sink = std::make_unique<Waved::FileSink>(
+                sink_name.substr(5).data()
+            );
+        }
+
+        temperature_file.emplace(temperature);
+        sensor_path = temperature_file->get_path();
+    }
+
+    // Number of frames sent for an update in each mode
+    std::vector<std::size_t> lengths;
+
+    for (Waved::ModeID mode = 0; mode < table.get_mode_count(); ++mode) {
+        lengths.push_back(table.lookup(mode, temperature).size());
+    }
+
+    auto counter = std::make_unique<CountingSink>(std::move(sink));
+    auto& frames = *counter;
+    const auto mode_count = table.get_mode_count();
+    std::vector<std::string> mode_names;
+
+    for (Waved::ModeID mode = 0; mode < mode_count; ++mode) {
+        mode_names.push_back(
+            std::to_string(mode) + ':'
+            + Waved::mode_kind_to_string(table.get_mode_kind(mode))
+        );
+    }
+
+    Waved::Display display{
+        std::move(counter), sensor_path.data(), std::move(table)
+    };
+
+    // Only send the frames of the pushed updates, and keep the panel on
+    display.set_cleanup(Waved::ModeKind::GC16, 0);
+    display.set_power_off_timeout(chrono::seconds{10});
+    display.start();
+
+    constexpr chrono::seconds frames_timeout{10};
+    std::mt19937 generator(424242);
+    std::uniform_int_distribution<int> distrib(0, 15);
+
+    for (const auto& [width, height] : region_sizes) {
+        std::vector<Waved::Intensity> buffer(width * height);
+
+        for (auto& value : buffer) {
+            value = distrib(generator) * 2;
+        }
+
+        for (Waved::ModeID mode = 0; mode < mode_count; ++mode) {
+            Waved::Region region{0, 0, width, height};
+            const auto push = [&] {
+                auto total = frames.get_frame_count() + lengths[mode];
+
+                if (!display.push_update(mode, region, buffer)) {
+                    return false;
+                }
+
+                if (!frames.wait_frames(total, frames_timeout)) {
+                    throw std::runtime_error("Timed out waiting for frames");
+                }
+
+                return true;
+            };
+
+            try {
+                // Skip unsupported modes and warm up
+                if (!push()) {
+                    continue;
+                }
+
+                report.add(
+                    "pipeline", mode_names[mode], width, height,
+                    measure(push)
+                );
+            } catch (const std::runtime_error& err) {
+                std::cerr << "[error] Pipeline " << mode_names[mode] << ' '
+                    << width << 'x' << height << ": " << err.what() << '\n';
+                return false;
+            }
+        }
+    }
+
+    display.stop();
+
+    if (emulated) {
+        auto hazards = emulated->get_hazards();
+        std::cerr << "[info] Emulated MXSFB hazards: "
+            << hazards.scanout_writes << " scan-out writes, "
+            << hazards.default_writes << " default slot writes, "
+            << hazards.unpowered_frames << " unpowered frames\n";
+
+        if (
+            hazards.scanout_writes > 0
+            || hazards.default_writes > 0
+            || hazards.unpowered_frames > 0
+        ) {
+            std::cerr << "[error] Frames were sent unsafely\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void print_help(std::ostream& out, const char* name)
+{
+    out << "Usage: " << name << " [-h|--help] [--csv] [--sink SINK] [FILE]\n";
+    out << "Run microbenchmarks for the update pipeline.\n\n";
+    out << "The benchmarks that need waveforms use the WBF file FILE, or\n";
+    out << "the one of the device if none is given, and are skipped if no\n";
+    out << "file is available. With --csv, results are printed as CSV.\n\n";
+    out << "The pipeline benchmark runs a started display, which sends its\n";
+    out << "frames to SINK:\n";
+    out << "  memory     discard the frames (default)\n";
+    out << "  file:PATH  append the frames to the file at PATH\n";
+    out << "  mxsfb      drive the panel of the device\n";
+    out << "  emulated   emulate the timing of the panel and fail if frames\n";
+    out << "             are written to the buffer slot being scanned out,\n";
+    out << "             to the default slot or while the panel is off\n";
+}
+
+int main(int argc, const char** argv)
+{
+    const char* name = argv[0];
+    bool csv = false;
+    std::string sink_name = "memory";
+    std::optional<std::string> wbf_path;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            print_help(std::cout, name);
+            return 0;
+        }
+
+        if (arg == "--csv") {
+            csv = true;
+        } else if (arg == "--sink" && i + 1 < argc) {
+            sink_name = argv[++i];
+
+            if (!is_valid_sink(sink_name)) {
+                std::cerr << "Unknown sink: " << sink_name << '\n';
+                print_help(std::cerr, name);
+                return 1;
+            }
+        } else if (!wbf_path && !arg.empty() && arg[0] != '-') {
+            wbf_path = arg;
+        } else {
+            print_help(std::cerr, name);
+            return 1;
+        }
+    }
+
+    if (!wbf_path) {
+        wbf_path = Waved::WaveformTable::discover_wbf_file();
+    }
+
+    Report report(std::cout, csv);
+    bool success = check_transforms();
+    bench_transform(report);
+    bench_orientations(report);
+    bench_formats(report);
+
+    if (!wbf_path) {
+        std::cerr << "[warn] No WBF file found, skipping the benchmarks "
+            "that need waveforms\n";
+        return success ? 0 : 1;
+    }
+
+    try {
+        std::ifstream file{*wbf_path, std::ios::binary};
+
+        if (!file) {
+            throw std::system_error(
+                errno, std::generic_category(), "Open " + *wbf_path
+            );
+        }
+
+        std::string contents{
+            std::istreambuf_iterator<char>(file),
+            std::istreambuf_iterator<char>()
+        };
+
+        bench_wbf(report, contents);
+
+        std::istringstream stream{contents};
+        auto bench = std::make_unique<Waved::DisplayBench>(
+            Waved::WaveformTable::from_wbf(stream)
+        );
+        bench->run(report);
+        bench.reset();
+
+        if (!bench_pipeline(report, sink_name, contents)) {
+            return 1;
+        }
+    } catch (const std::system_error& err) {
+        std::cerr << "I/O error: " << err.what() << '\n';
+        return 1;
+    } catch (const std::runtime_error& err) {
+        std::cerr << "Parse error: " << err.what() << '\n';
+        return 1;
+    }
+
+    return success ? 0 : 1;
+}
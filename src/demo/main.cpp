@@ -18,13 +18,13 @@
 
 void do_init(Waved::Display& display)
 {
-    display.push_update(
+    display.push_fill(
         Waved::ModeKind::INIT,
         Waved::Region{
             /* top = */ 0, /* left = */ 0,
             /* width = */ 1404, /* height = */ 1872
         },
-        std::vector<Waved::Intensity>(1404 * 1872, 30)
+        30
     );
 }
 
@@ -87,6 +87,68 @@ void do_continuous_gradients(Waved::Display& display)
     }
 }
 
+void do_scroll(Waved::Display& display)
+{
+    using namespace std::literals::chrono_literals;
+    constexpr std::uint32_t step = 150;
+
+    for (int i = 0; i < 8; ++i) {
+        // Move the screen contents up and clear the exposed strip
+        display.push_copy(
+            Waved::ModeKind::DU,
+            Waved::Region{
+                /* top = */ step, /* left = */ 0,
+                /* width = */ 1404, /* height = */ 1872 - step
+            },
+            Waved::Point{/* top = */ 0, /* left = */ 0}
+        );
+
+        display.push_fill(
+            Waved::ModeKind::DU,
+            Waved::Region{
+                /* top = */ 1872 - step, /* left = */ 0,
+                /* width = */ 1404, /* height = */ step
+            },
+            30
+        );
+
+        std::this_thread::sleep_for(500ms);
+    }
+}
+
+void do_animation(Waved::Display& display)
+{
+    using namespace std::literals::chrono_literals;
+    constexpr std::uint32_t size = 200;
+    constexpr std::uint32_t bar = 20;
+
+    auto animation = display.start_animation(Waved::Region{
+        /* top = */ 836, /* left = */ 602,
+        /* width = */ size, /* height = */ size
+    });
+
+    if (!animation) {
+        return;
+    }
+
+    // Push a bar sweeping across the region faster than it can be displayed
+    for (std::uint32_t i = 0; i < 3 * size; i += 4) {
+        std::vector<Waved::Intensity> buffer(size * size, 30);
+
+        for (std::uint32_t y = 0; y < size; ++y) {
+            for (std::uint32_t x = 0; x < bar; ++x) {
+                buffer[y * size + (i + x) % size] = 0;
+            }
+        }
+
+        display.push_frame(*animation, std::move(buffer));
+        std::this_thread::sleep_for(10ms);
+    }
+
+    std::cerr << "[test] Dropped frames: "
+        << display.stop_animation(*animation) << '\n';
+}
+
 void do_all_diff(Waved::Display& display)
 {
     std::vector<Waved::Intensity> buffer(1404 * 1872);
@@ -158,6 +220,39 @@ void do_spiral(Waved::Display& display)
     }
 }
 
+void do_spiral_stroke(Waved::Display& display)
+{
+    using namespace std::literals::chrono_literals;
+    int count = 500;
+    double resol = 20.;
+    double resol_scaling = 0.09;
+    int scale = 75;
+
+    std::uint32_t pen = 6;
+    std::uint32_t width = 1404;
+    std::uint32_t height = 1872;
+
+    Waved::Point last{height / 2, width / 2 + scale};
+
+    for (int i = 0; i < count; ++i) {
+        auto t = i / (resol + i * resol_scaling);
+        auto ampl = std::exp(0.30635 * t);
+
+        Waved::Point next{
+            /* top = */ static_cast<std::uint32_t>(
+                height / 2 - std::round(std::sin(t) * ampl * scale)
+            ),
+            /* left = */ static_cast<std::uint32_t>(
+                width / 2 + std::round(std::cos(t) * ampl * scale)
+            ),
+        };
+
+        display.push_stroke(Waved::ModeKind::A2, {last, next}, pen, 0);
+        last = next;
+        std::this_thread::sleep_for(30ms);
+    }
+}
+
 void do_image(Waved::Display& display)
 {
     std::ifstream image{"./image.pgm"};
@@ -358,6 +453,15 @@ int main(int argc, const char** argv)
     do_continuous_gradients(display);
     std::this_thread::sleep_for(15s);
 
+    std::cerr << "[test] Scroll\n";
+    do_scroll(display);
+    std::this_thread::sleep_for(5s);
+
+    std::cerr << "[test] Animation\n";
+    do_init(display);
+    do_animation(display);
+    std::this_thread::sleep_for(5s);
+
     std::cerr << "[test] Image\n";
     do_init(display);
     do_image(display);
@@ -379,6 +483,12 @@ int main(int argc, const char** argv)
     do_spiral(display);
     std::this_thread::sleep_for(5s);
 
+    std::cerr << "[test] Spiral strokes\n";
+    do_init(display);
+    std::this_thread::sleep_for(4s);
+    do_spiral_stroke(display);
+    std::this_thread::sleep_for(5s);
+
     std::cerr << "[test] End\n";
     do_init(display);
     std::this_thread::sleep_for(3s);
@@ -103,7 +103,7 @@ void do_update(Waved::Display &display, const swtfb::swtfb_update &s) {
   display.push_update(
     waveform,
     region,
-    buffer
+    std::move(buffer)
   );
 
 }